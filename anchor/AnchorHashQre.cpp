@@ -20,7 +20,11 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 #include "AnchorHashQre.hpp"
-#include "./misc/crc32c_sse42_u64.h"
+#include "../hash/crc32c.h"
+#include "../hash/fastrange.h"
+#include "../hash/mix.h"
+#include "../stats/hopstats.h"
+#include <algorithm>
 
 using namespace std;
 
@@ -58,6 +62,39 @@ AnchorHashQre::AnchorHashQre (uint32_t a, uint32_t w) {
 			
 }
 
+/** Copy constructor (deep copy of the arrays) */
+AnchorHashQre::AnchorHashQre (const AnchorHashQre& other) : M(other.M), N(other.N), r(other.r) {
+
+	A = new uint32_t [M];
+	W = new uint32_t [M];
+	L = new uint32_t [M];
+	K = new uint32_t [M];
+
+	std::copy(other.A, other.A + M, A);
+	std::copy(other.W, other.W + M, W);
+	std::copy(other.L, other.L + M, L);
+	std::copy(other.K, other.K + M, K);
+
+}
+
+/** Copy assignment */
+AnchorHashQre& AnchorHashQre::operator= (const AnchorHashQre& other) {
+
+	if (this != &other) {
+		AnchorHashQre copy(other);
+		std::swap(A, copy.A);
+		std::swap(W, copy.W);
+		std::swap(L, copy.L);
+		std::swap(K, copy.K);
+		std::swap(M, copy.M);
+		std::swap(N, copy.N);
+		std::swap(r, copy.r);
+	}
+
+	return *this;
+
+}
+
 /** Destructor */
 AnchorHashQre::~AnchorHashQre () {
 	
@@ -68,49 +105,176 @@ AnchorHashQre::~AnchorHashQre () {
 
 }
 
-uint32_t AnchorHashQre::ComputeTranslation(uint32_t i , uint32_t j) {
+uint32_t AnchorHashQre::ComputeTranslation(uint32_t i , uint32_t j) const {
 	
 	if (i == j) return K[i];
 	
 	uint32_t b = j;
+	HOPSTATS_DECLARE(hops);
 	
 	while (A[i] <= A[b]) {
+		HOPSTATS_INCREMENT(hops);
 		b = K[b];
 	}
+	HOPSTATS_RECORD(AnchorTranslation, hops);
 	
 	return b;
 
 }
 
-uint32_t AnchorHashQre::ComputeBucket(uint64_t key1 , uint64_t key2) {
+uint32_t AnchorHashQre::ComputeBucket(uint64_t key1 , uint64_t key2) const {
+
+	return ComputeBucketFromHash(key1, key2, crc32c_sse42_u64(key1, key2));
+
+}
+
+uint32_t AnchorHashQre::ComputeBucketFromHash(uint64_t key1 , uint64_t key2, uint32_t bs) const {
+
+	return Compute<false>(key1, key2, bs);
+
+}
+
+uint32_t AnchorHashQre::ComputeBucketFastRange(uint64_t key1 , uint64_t key2, uint32_t bs) const {
+
+	return Compute<true>(key1, key2, bs);
+
+}
+
+template <bool FastRange>
+uint32_t AnchorHashQre::Compute(uint64_t key1 , uint64_t key2, uint32_t bs) const {
 								
 	// First hash is uniform on the anchor set
-	uint32_t bs = crc32c_sse42_u64(key1, key2);
-	uint32_t b = bs % M;
+	return Walk<FastRange>(key1, key2, FastRange ? fastrange32(bs, M) : bs % M, bs);
+										
+}
+
+template <bool FastRange>
+uint32_t AnchorHashQre::Walk(uint64_t key1 , uint64_t key2, uint32_t b, uint32_t bs) const {
+								
+	HOPSTATS_DECLARE(hops);
 						
 	// Loop until hitting a working bucket
 	while (A[b] != 0) {	
+		HOPSTATS_INCREMENT(hops);
 			
 		// New candidate (bs - for better balance - avoid patterns)			
 		bs = crc32c_sse42_u64(key1 - bs, key2 + bs);
-		uint32_t h = bs % A[b];
+		uint32_t h = FastRange ? fastrange32(bs, A[b]) : bs % A[b];
 				
-		//  h is working or observed by bucket
-		if ((A[h] == 0) || (A[h] < A[b])) {
-			b = h;
-		}
-						
-		// need translation for (bucket, h)
-		else {
-			b = ComputeTranslation(b,h);				
-		}
+		b = Next(b, h);
 										
 	}
+	HOPSTATS_RECORD(AnchorBucket, hops);
 		
 	return b;
 										
 }
 
+uint32_t AnchorHashQre::Next(uint32_t b , uint32_t h) const {
+
+	//  h is working or observed by bucket
+	if ((A[h] == 0) || (A[h] < A[b])) {
+		return h;
+	}
+						
+	// need translation for (bucket, h)
+	return ComputeTranslation(b,h);				
+
+}
+
+template <bool FastRange>
+pair<uint32_t, uint32_t> AnchorHashQre::ComputePair(uint64_t key1 , uint64_t key2, uint32_t bs, const AnchorHashQre& other) const {
+
+	// Different anchor sets have different first candidates
+	if (M != other.M) {
+		return {Compute<FastRange>(key1, key2, bs), other.Compute<FastRange>(key1, key2, bs)};
+	}
+
+	uint32_t b = FastRange ? fastrange32(bs, M) : bs % M;
+
+	// Both states draw the same candidates while the bucket was removed at
+	// the same size in both, and its candidate resolves to the same bucket
+	while (A[b] != 0 && A[b] == other.A[b]) {
+		bs = crc32c_sse42_u64(key1 - bs, key2 + bs);
+		uint32_t h = FastRange ? fastrange32(bs, A[b]) : bs % A[b];
+		uint32_t n = Next(b, h);
+		uint32_t o = other.Next(b, h);
+		if (n != o) {
+			return {Walk<FastRange>(key1, key2, n, bs), other.Walk<FastRange>(key1, key2, o, bs)};
+		}
+		b = n;
+	}
+
+	// Working in both states, or the states diverge at b
+	if (A[b] == other.A[b]) {
+		return {b, b};
+	}
+	return {Walk<FastRange>(key1, key2, b, bs), other.Walk<FastRange>(key1, key2, b, bs)};
+
+}
+
+pair<uint32_t, uint32_t> AnchorHashQre::ComputeBucketPair(uint64_t key1 , uint64_t key2, uint32_t bs, const AnchorHashQre& other) const {
+
+	return ComputePair<false>(key1, key2, bs, other);
+
+}
+
+pair<uint32_t, uint32_t> AnchorHashQre::ComputeBucketPairFastRange(uint64_t key1 , uint64_t key2, uint32_t bs, const AnchorHashQre& other) const {
+
+	return ComputePair<true>(key1, key2, bs, other);
+
+}
+
+template <bool FastRange>
+uint32_t AnchorHashQre::ComputeWeighted(uint64_t key1 , uint64_t key2, uint32_t bs, const uint32_t* thresholds) const {
+
+	// The draws are numbered, so that the hashes do not cycle (the
+	// re-hash of Walk can, e.g. alternate between two values)
+	uint64_t n = 0;
+
+	// First hash is uniform on the anchor set, redrawn until kept
+	uint32_t b = FastRange ? fastrange32(bs, M) : bs % M;
+	while ((mix32(bs) >> 1) >= thresholds[b]) {
+		bs = crc32c_sse42_u64(key1 - bs, key2 + bs + ++n);
+		b = FastRange ? fastrange32(bs, M) : bs % M;
+	}
+
+	HOPSTATS_DECLARE(hops);
+
+	// Loop until hitting a working bucket
+	while (A[b] != 0) {
+		HOPSTATS_INCREMENT(hops);
+
+		// The candidate only depends on (b, h), so that it is the same
+		// whether it is working or removed: redrawing it from b when it is
+		// not kept does not depend on the state of the candidate
+		uint32_t c;
+		do {
+			bs = crc32c_sse42_u64(key1 - bs, key2 + bs + ++n);
+			uint32_t h = FastRange ? fastrange32(bs, A[b]) : bs % A[b];
+			c = Next(b, h);
+		} while ((mix32(bs) >> 1) >= thresholds[c]);
+
+		b = c;
+	}
+	HOPSTATS_RECORD(AnchorBucket, hops);
+
+	return b;
+
+}
+
+uint32_t AnchorHashQre::ComputeBucketWeighted(uint64_t key1 , uint64_t key2, uint32_t bs, const uint32_t* thresholds) const {
+
+	return ComputeWeighted<false>(key1, key2, bs, thresholds);
+
+}
+
+uint32_t AnchorHashQre::ComputeBucketWeightedFastRange(uint64_t key1 , uint64_t key2, uint32_t bs, const uint32_t* thresholds) const {
+
+	return ComputeWeighted<true>(key1, key2, bs, thresholds);
+
+}
+
 uint32_t AnchorHashQre::UpdateRemoval(uint32_t b) {
 
 	// update reserved stack
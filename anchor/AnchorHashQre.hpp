@@ -22,6 +22,7 @@
 #include <iostream>
 #include <stack>
 #include <stdint.h>
+#include <utility>
 
 /** Class declaration */
 class AnchorHashQre {
@@ -50,15 +51,63 @@ class AnchorHashQre {
 	std::stack<uint32_t> r;
             
 	// Translation oracle
-	uint32_t ComputeTranslation(uint32_t i , uint32_t j);
+	uint32_t ComputeTranslation(uint32_t i , uint32_t j) const;
+
+	// Bucket lookup, reducing the hashes with a modulo or with fastrange
+	template <bool FastRange>
+	uint32_t Compute(uint64_t, uint64_t, uint32_t) const;
+
+	// Bucket lookup from a candidate bucket and its last hash
+	template <bool FastRange>
+	uint32_t Walk(uint64_t, uint64_t, uint32_t, uint32_t) const;
+
+	// Next candidate after drawing h from the removed bucket b
+	uint32_t Next(uint32_t, uint32_t) const;
+
+	// Bucket lookup in this state and in another one
+	template <bool FastRange>
+	std::pair<uint32_t, uint32_t> ComputePair(uint64_t, uint64_t, uint32_t, const AnchorHashQre&) const;
+
+	// Bucket lookup keeping each candidate with a per-bucket probability
+	template <bool FastRange>
+	uint32_t ComputeWeighted(uint64_t, uint64_t, uint32_t, const uint32_t*) const;
 					
   public:
   
 	AnchorHashQre (uint32_t, uint32_t);
+
+	AnchorHashQre (const AnchorHashQre&);
+
+	AnchorHashQre& operator= (const AnchorHashQre&);
 	
 	~AnchorHashQre();
 		
-	uint32_t ComputeBucket(uint64_t, uint64_t);
+	uint32_t ComputeBucket(uint64_t, uint64_t) const;
+
+	// Same as ComputeBucket, starting from the first hash of the key
+	uint32_t ComputeBucketFromHash(uint64_t, uint64_t, uint32_t) const;
+
+	// Same as ComputeBucketFromHash, reducing the hashes with fastrange
+	// instead of a modulo (a different mapping)
+	uint32_t ComputeBucketFastRange(uint64_t, uint64_t, uint32_t) const;
+
+	// Same as ComputeBucketFromHash (or ComputeBucketFastRange) in this
+	// state and in another one, following a single path until they diverge
+	std::pair<uint32_t, uint32_t> ComputeBucketPair(uint64_t, uint64_t, uint32_t, const AnchorHashQre&) const;
+
+	std::pair<uint32_t, uint32_t> ComputeBucketPairFastRange(uint64_t, uint64_t, uint32_t, const AnchorHashQre&) const;
+
+	// Same as ComputeBucketFromHash, keeping a candidate c (removed or not)
+	// only if mix32(hash) / 2 < thresholds[c] (otherwise the candidate is
+	// drawn again from the same bucket): with thresholds proportional to
+	// weights, a working bucket gets keys in proportion to its weight.
+	// thresholds has one entry per bucket of the anchor set
+	uint32_t ComputeBucketWeighted(uint64_t, uint64_t, uint32_t, const uint32_t*) const;
+
+	uint32_t ComputeBucketWeightedFastRange(uint64_t, uint64_t, uint32_t, const uint32_t*) const;
+
+	// Size of the working set
+	uint32_t WorkingSize() const { return N; }
         
 	uint32_t UpdateRemoval(uint32_t);
     
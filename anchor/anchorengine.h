@@ -16,10 +16,26 @@
 #ifndef ANCHORENGINE_H
 #define ANCHORENGINE_H
 #include "AnchorHashQre.hpp"
+#include "../hash/crc32c.h"
+#include "../hash/fastrange.h"
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * AnchorHash engine.
+ * <p>
+ * Options: FastRange reduces the hashes with fastrange instead of a modulo
+ * (a different mapping).
+ *
+ * @tparam Args the options
+ */
+template <typename... Args> class BasicAnchorEngine final {
+    static constexpr bool FAST_RANGE =
+        (std::is_same_v<Args, FastRange> || ...);
 
-class AnchorEngine final {
 public:
-    AnchorEngine(uint32_t anchor_set, uint32_t working_set)
+    BasicAnchorEngine(uint32_t anchor_set, uint32_t working_set)
         : m_anchor{anchor_set, working_set}
     {}
 
@@ -31,9 +47,116 @@ public:
    * @param seed the initial seed for CRC32c
    * @return the related bucket
    */
-    uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) noexcept
+    uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept
+    {
+        if constexpr (FAST_RANGE) {
+            return resolve(key, seed, crc32c_sse42_u64(key, seed));
+        } else {
+            return m_anchor.ComputeBucket(key, seed);
+        }
+    }
+
+    /**
+   * Returns the bucket where the given key should be mapped, given the
+   * CRC32c hash of the key computed beforehand (e.g. by crc32cBatch): same
+   * result as getBucketCRC32c(key, seed) when hash is
+   * crc32c_sse42_u64(key, seed).
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param hash the CRC32c hash of the key with the seed
+   * @return the related bucket
+   */
+    uint32_t getBucketFromHash(uint64_t key, uint64_t seed,
+                               uint32_t hash) const noexcept
+    {
+        return resolve(key, seed, hash);
+    }
+
+    /**
+   * Returns the bucket where the given key should be mapped when every
+   * candidate c of the lookup (the first one in the anchor set, then one
+   * for each removed bucket met) is kept only if a hash of the key is below
+   * thresholds[c], and drawn again from the same bucket otherwise (see
+   * WeightedEngine). The candidates do not depend on the state of the
+   * buckets, so the lookup is as monotone as getBucketCRC32c.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param thresholds per bucket of the anchor set, 2^31 times the
+   *                   probability of keeping it (not 0)
+   * @return the related bucket
+   */
+    uint32_t
+    getBucketWeightedCRC32c(uint64_t key, uint64_t seed,
+                            const std::vector<uint32_t> &thresholds) const noexcept
+    {
+        const uint32_t hash = crc32c_sse42_u64(key, seed);
+        if constexpr (FAST_RANGE) {
+            return m_anchor.ComputeBucketWeightedFastRange(key, seed, hash,
+                                                           thresholds.data());
+        } else {
+            return m_anchor.ComputeBucketWeighted(key, seed, hash,
+                                                  thresholds.data());
+        }
+    }
+
+    /**
+   * Returns the buckets where the given key is mapped by this engine and by
+   * another state of it (e.g. before and after a membership change). The
+   * first candidate in the anchor set is computed once, and the candidates
+   * are drawn once for both states as long as the current bucket was
+   * removed at the same size in both and its candidate resolves to the same
+   * bucket; from the first difference each state completes its own lookup.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param other the other state of the engine
+   * @return the bucket in this state and the bucket in the other state
+   */
+    std::pair<uint32_t, uint32_t>
+    getBucketPairCRC32c(uint64_t key, uint64_t seed,
+                        const BasicAnchorEngine &other) const noexcept
+    {
+        const uint32_t hash = crc32c_sse42_u64(key, seed);
+        if constexpr (FAST_RANGE) {
+            return m_anchor.ComputeBucketPairFastRange(key, seed, hash,
+                                                       other.m_anchor);
+        } else {
+            return m_anchor.ComputeBucketPair(key, seed, hash, other.m_anchor);
+        }
+    }
+
+    /**
+   * Returns count distinct working buckets where the given key should be
+   * replicated. The first one is the bucket returned by getBucketCRC32c.
+   * The candidates come from a single stream of hashes, each derived from
+   * the previous one with one CRC32c step, and duplicates are skipped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param count the number of replicas
+   * @param out the resulting buckets (at least count elements)
+   * @return the number of replicas, that is min(count, working set size)
+   */
+    uint32_t getReplicasCRC32c(uint64_t key, uint64_t seed, uint32_t count,
+                               uint32_t *out) const noexcept
     {
-        return m_anchor.ComputeBucket(key, seed);
+        auto working{m_anchor.WorkingSize()};
+        count = count < working ? count : working;
+        uint32_t hash = crc32c_sse42_u64(key, seed);
+        for (uint32_t n = 0; n < count;) {
+            const auto b = resolve(key, seed, hash);
+            uint32_t i = 0;
+            while (i < n && out[i] != b) {
+                ++i;
+            }
+            if (i == n) {
+                out[n++] = b;
+            }
+            hash = crc32c_sse42_u64(hash, key);
+        }
+        return count;
     }
 
     /**
@@ -56,7 +179,18 @@ public:
     }
 
 private:
+  /* Returns the bucket of a key, starting from its first hash */
+  uint32_t resolve(uint64_t key, uint64_t seed, uint32_t hash) const noexcept {
+    if constexpr (FAST_RANGE) {
+      return m_anchor.ComputeBucketFastRange(key, seed, hash);
+    } else {
+      return m_anchor.ComputeBucketFromHash(key, seed, hash);
+    }
+  }
+
   AnchorHashQre m_anchor;
 };
 
+using AnchorEngine = BasicAnchorEngine<>;
+
 #endif // ANCHORENGINE_H
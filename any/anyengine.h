@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ANYENGINE_H
+#define ANYENGINE_H
+#include "../anchor/anchorengine.h"
+#include "../bounded/boundedengine.h"
+#include "../cache/cachedengine.h"
+#include "../jump/jumpengine.h"
+#include "../memento/mashtable.h"
+#include "../memento/mementoengine.h"
+#include "../power/powerengine.h"
+#include "../weighted/weightedengine.h"
+#include <boost/unordered/unordered_flat_map.hpp>
+#include <boost/unordered_map.hpp>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <gtl/phmap.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+
+/**
+ * The interface shared by every engine: created from the size of the
+ * anchor set and of the working set, it maps keys to buckets and adds or
+ * removes buckets (returning the bucket actually added or removed).
+ */
+template <typename Engine>
+concept ConsistentHashEngine =
+    std::constructible_from<Engine, uint32_t, uint32_t> &&
+    requires(Engine &engine, uint64_t key, uint64_t seed, uint32_t bucket) {
+      { engine.getBucketCRC32c(key, seed) } -> std::convertible_to<uint32_t>;
+      { engine.addBucket() } -> std::convertible_to<uint32_t>;
+      { engine.removeBucket(bucket) } -> std::convertible_to<uint32_t>;
+    };
+
+/**
+ * An engine that places keys instead of mapping them (e.g.
+ * BoundedLoadEngine): the bucket of a key depends on the keys placed before
+ * it, so the engine has no read-only lookup. The caller keeps the bucket
+ * returned by place() and gives it back to release().
+ */
+template <typename Engine>
+concept PlacementEngine =
+    std::constructible_from<Engine, uint32_t, uint32_t> &&
+    requires(Engine &engine, uint64_t key, uint64_t seed, uint32_t bucket) {
+      { engine.place(key, seed) } -> std::convertible_to<uint32_t>;
+      engine.release(bucket);
+      { engine.addBucket() } -> std::convertible_to<uint32_t>;
+      { engine.removeBucket(bucket) } -> std::convertible_to<uint32_t>;
+    };
+
+/**
+ * Looks up a batch of keys, with the batch entry point of the engine if it
+ * has one (getBucketsCRC32c), otherwise key by key.
+ *
+ * @param engine the engine
+ * @param keys the keys to map
+ * @param seeds the initial seeds for CRC32c (one per key)
+ * @param count the number of keys
+ * @param out the resulting buckets (at least count elements)
+ */
+template <typename Engine>
+inline void getBucketsCRC32c(Engine &engine, const uint64_t *keys,
+                             const uint64_t *seeds, size_t count,
+                             uint32_t *out) noexcept {
+  if constexpr (requires { engine.getBucketsCRC32c(keys, seeds, count, out); }) {
+    engine.getBucketsCRC32c(keys, seeds, count, out);
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = engine.getBucketCRC32c(keys[i], seeds[i]);
+    }
+  }
+}
+
+/**
+ * The name of an engine on the command line (key) and in the results
+ * (label). Wrappers compose the names of the wrapped engine.
+ */
+template <typename Engine> struct EngineName;
+
+template <> struct EngineName<AnchorEngine> {
+  static std::string key() { return "anchor"; }
+  static std::string label() { return "Anchor"; }
+};
+
+template <> struct EngineName<BasicAnchorEngine<FastRange>> {
+  static std::string key() { return "anchorfast"; }
+  static std::string label() { return "Anchor<FastRange>"; }
+};
+
+template <> struct EngineName<MementoEngine<boost::unordered_flat_map>> {
+  static std::string key() { return "memento"; }
+  static std::string label() { return "Memento<boost::unordered_flat_map>"; }
+};
+
+template <> struct EngineName<MementoEngine<boost::unordered_map>> {
+  static std::string key() { return "mementoboost"; }
+  static std::string label() { return "Memento<boost::unordered_map>"; }
+};
+
+template <> struct EngineName<MementoEngine<std::unordered_map>> {
+  static std::string key() { return "mementostd"; }
+  static std::string label() { return "Memento<std::unordered_map>"; }
+};
+
+template <> struct EngineName<MementoEngine<gtl::flat_hash_map>> {
+  static std::string key() { return "mementogtl"; }
+  static std::string label() { return "Memento<std::gtl::flat_hash_map>"; }
+};
+
+template <> struct EngineName<MementoEngine<MashTable>> {
+  static std::string key() { return "mementomash"; }
+  static std::string label() { return "Memento<MashTable>"; }
+};
+
+template <>
+struct EngineName<MementoEngine<boost::unordered_flat_map, PathCompression>> {
+  static std::string key() { return "mementopc"; }
+  static std::string label() {
+    return "Memento<boost::unordered_flat_map, PathCompression>";
+  }
+};
+
+template <>
+struct EngineName<MementoEngine<boost::unordered_flat_map, DigestRehash>> {
+  static std::string key() { return "mementodigest"; }
+  static std::string label() {
+    return "Memento<boost::unordered_flat_map, DigestRehash>";
+  }
+};
+
+template <>
+struct EngineName<MementoEngine<boost::unordered_flat_map, FastRange>> {
+  static std::string key() { return "mementofast"; }
+  static std::string label() {
+    return "Memento<boost::unordered_flat_map, FastRange>";
+  }
+};
+
+template <> struct EngineName<JumpEngine> {
+  static std::string key() { return "jump"; }
+  static std::string label() { return "JumpEngine"; }
+};
+
+template <> struct EngineName<BasicJumpEngine<IntegerJump>> {
+  static std::string key() { return "jumpint"; }
+  static std::string label() { return "JumpEngine<IntegerJump>"; }
+};
+
+template <> struct EngineName<PowerEngine> {
+  static std::string key() { return "power"; }
+  static std::string label() { return "PowerEngine"; }
+};
+
+/* Wrapped engines are named after the shortest key (memento, anchor) */
+template <typename Engine> struct EngineName<WeightedEngine<Engine>> {
+  static std::string key() { return "weighted" + EngineName<Engine>::key(); }
+  static std::string label() {
+    return "Weighted<" + EngineName<Engine>::label() + ">";
+  }
+};
+
+template <typename Engine> struct EngineName<BoundedLoadEngine<Engine>> {
+  static std::string key() { return "bounded" + EngineName<Engine>::key(); }
+  static std::string label() {
+    return "Bounded<" + EngineName<Engine>::label() + ">";
+  }
+};
+
+template <typename Engine> struct EngineName<CachedEngine<Engine>> {
+  static std::string key() { return "cached" + EngineName<Engine>::key(); }
+  static std::string label() {
+    return "Cached<" + EngineName<Engine>::label() + ">";
+  }
+};
+
+/**
+ * One engine among a closed set of engines, selected at run time (e.g. from
+ * a configuration) and stored in place in a std::variant.
+ * <p>
+ * A call is dispatched with a switch over the alternatives instead of a
+ * virtual call, and the batch lookup dispatches once for the whole batch,
+ * so that the per-key loop runs on the concrete engine and is inlined.
+ *
+ * @tparam Engines the engines that can be selected
+ */
+template <ConsistentHashEngine... Engines> class BasicAnyEngine final {
+public:
+  /**
+   * Creates the engine with the given name.
+   *
+   * @param name the key of the engine (e.g. "memento", see EngineName)
+   * @param anchor_set size of the anchor set (forwarded to the engine)
+   * @param working_set initial number of working buckets
+   * @throws std::invalid_argument if no engine has the given name
+   */
+  BasicAnyEngine(std::string_view name, uint32_t anchor_set,
+                 uint32_t working_set)
+      : m_engine{make<0>(name, anchor_set, working_set)} {}
+
+  /**
+   * Creates an engine of the given type.
+   *
+   * @param anchor_set size of the anchor set (forwarded to the engine)
+   * @param working_set initial number of working buckets
+   */
+  template <typename Engine>
+  BasicAnyEngine(std::in_place_type_t<Engine> type, uint32_t anchor_set,
+                 uint32_t working_set)
+      : m_engine{type, anchor_set, working_set} {}
+
+  /**
+   * Returns true if an engine has the given name.
+   *
+   * @param name the key of the engine
+   * @return true if the name is known
+   */
+  static bool contains(std::string_view name) {
+    return ((EngineName<Engines>::key() == name) || ...);
+  }
+
+  /**
+   * Returns the keys of the engines separated by '|'.
+   *
+   * @return the names of the engines
+   */
+  static std::string names() {
+    std::string out;
+    ((out += (out.empty() ? "" : "|") + EngineName<Engines>::key()), ...);
+    return out;
+  }
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept {
+    return std::visit(
+        [&](const auto &e) -> uint32_t { return e.getBucketCRC32c(key, seed); },
+        m_engine);
+  }
+
+  /**
+   * Returns the bucket where the given key should be mapped (for engines
+   * that update their state on lookups).
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) noexcept {
+    return std::visit(
+        [&](auto &e) -> uint32_t { return e.getBucketCRC32c(key, seed); },
+        m_engine);
+  }
+
+  /**
+   * Returns the buckets where the given keys should be mapped.
+   *
+   * @param keys the keys to map
+   * @param seeds the initial seeds for CRC32c (one per key)
+   * @param count the number of keys
+   * @param out the resulting buckets (at least count elements)
+   */
+  void getBucketsCRC32c(const uint64_t *keys, const uint64_t *seeds,
+                        size_t count, uint32_t *out) const noexcept {
+    std::visit(
+        [&](const auto &e) { ::getBucketsCRC32c(e, keys, seeds, count, out); },
+        m_engine);
+  }
+
+  /**
+   * Returns the buckets where the given keys should be mapped (for engines
+   * that update their state on lookups).
+   *
+   * @param keys the keys to map
+   * @param seeds the initial seeds for CRC32c (one per key)
+   * @param count the number of keys
+   * @param out the resulting buckets (at least count elements)
+   */
+  void getBucketsCRC32c(const uint64_t *keys, const uint64_t *seeds,
+                        size_t count, uint32_t *out) noexcept {
+    std::visit([&](auto &e) { ::getBucketsCRC32c(e, keys, seeds, count, out); },
+               m_engine);
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() {
+    return std::visit([](auto &e) -> uint32_t { return e.addBucket(); },
+                      m_engine);
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) {
+    return std::visit(
+        [&](auto &e) -> uint32_t { return e.removeBucket(bucket); }, m_engine);
+  }
+
+  /**
+   * Returns the label of the selected engine.
+   *
+   * @return the label (e.g. "Memento<boost::unordered_flat_map>")
+   */
+  std::string label() const {
+    return std::visit(
+        [](const auto &e) {
+          return EngineName<std::remove_cvref_t<decltype(e)>>::label();
+        },
+        m_engine);
+  }
+
+  /**
+   * Calls f with the selected engine, e.g. to use the features of a
+   * specific engine (weights, replicas).
+   *
+   * @param f the function
+   * @return the result of f
+   */
+  template <typename F> decltype(auto) visit(F &&f) {
+    return std::visit(std::forward<F>(f), m_engine);
+  }
+
+  template <typename F> decltype(auto) visit(F &&f) const {
+    return std::visit(std::forward<F>(f), m_engine);
+  }
+
+private:
+  using Variant = std::variant<Engines...>;
+
+  /* Returns the engine as a prvalue, so engines need not be movable */
+  template <size_t I>
+  static Variant make(std::string_view name, uint32_t anchor_set,
+                      uint32_t working_set) {
+    if constexpr (I == sizeof...(Engines)) {
+      throw std::invalid_argument{"Unknown engine " + std::string{name}};
+    } else {
+      using Engine = std::variant_alternative_t<I, Variant>;
+      if (EngineName<Engine>::key() == name) {
+        return Variant{std::in_place_index<I>, anchor_set, working_set};
+      }
+      return make<I + 1>(name, anchor_set, working_set);
+    }
+  }
+
+  Variant m_engine;
+};
+
+/**
+ * The engines with a read-only lookup that can be selected by name.
+ */
+using AnyEngine =
+    BasicAnyEngine<AnchorEngine, MementoEngine<boost::unordered_flat_map>,
+                   MementoEngine<MashTable>, JumpEngine, PowerEngine>;
+
+static_assert(ConsistentHashEngine<AnchorEngine>);
+static_assert(ConsistentHashEngine<MementoEngine<boost::unordered_flat_map>>);
+static_assert(ConsistentHashEngine<MementoEngine<MashTable>>);
+static_assert(ConsistentHashEngine<JumpEngine>);
+static_assert(ConsistentHashEngine<PowerEngine>);
+static_assert(ConsistentHashEngine<WeightedEngine<AnchorEngine>>);
+static_assert(PlacementEngine<BoundedLoadEngine<AnchorEngine>>);
+static_assert(ConsistentHashEngine<CachedEngine<AnchorEngine>>);
+
+#endif // ANYENGINE_H
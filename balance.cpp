@@ -22,32 +22,131 @@
 #include <random>
 #endif
 #include "anchor/anchorengine.h"
+#include "bench/affinity.h"
+#include "bench/keysource.h"
+#include "bench/lists.h"
+#include "bench/perfcounters.h"
+#include "bench/registry.h"
 #include "memento/mashtable.h"
 #include "memento/mementoengine.h"
 #include "jump/jumpengine.h"
 #include "power/powerengine.h"
+#include "bounded/boundedengine.h"
+#include "weighted/weightedengine.h"
+#include <algorithm>
+#include <cmath>
 #include <fmt/core.h>
 #include <fstream>
 #include <unordered_map>
 #include <gtl/phmap.hpp>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/*
+ * Benchmark parameters
+ */
+struct BalanceOptions final {
+  std::string filename;
+  uint32_t anchor_set;
+  uint32_t working_set;
+  uint32_t num_removals;
+  uint64_t num_keys;
+  std::vector<uint32_t> weights;
+  double epsilon;
+  std::string key_source;
+  uint32_t keyspace;
+  uint64_t seed;
+  bool perf;
+  /* Number of threads counting the keys */
+  uint32_t threads;
+  /* Number of most loaded buckets to report */
+  uint32_t top;
+  /* Number of bins of the load histogram */
+  uint32_t bins;
+};
+
+/*
+ * Returns the probability that a chi-square variable with the given degrees
+ * of freedom exceeds x, using the Wilson-Hilferty normal approximation
+ */
+double chi_square_pvalue(double x, double df) {
+  if (df <= 0) {
+    return 1.0;
+  }
+  const auto v = 2.0 / (9.0 * df);
+  const auto z = (std::cbrt(x / df) - (1.0 - v)) / std::sqrt(v);
+  return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
 
 /*
  * Benchmark routine
  */
 template <typename Algorithm>
-int bench(const std::string_view name, const std::string &filename,
-          uint32_t anchor_set, uint32_t working_set, uint32_t num_removals,
-          uint32_t num_keys) {
+int bench(const std::string_view name, const BalanceOptions &options) {
+  const auto &filename{options.filename};
+  const auto anchor_set{options.anchor_set};
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+  const auto num_keys{options.num_keys};
+  const auto &weights{options.weights};
+  const auto epsilon{options.epsilon};
+  const auto &key_source{options.key_source};
+  const auto keyspace{options.keyspace};
+  const auto seed{options.seed};
+  const auto threads{std::max(options.threads, 1u)};
 #ifdef USE_PCG32
-  pcg_extras::seed_seq_from<std::random_device> seed;
-  pcg32 rng{seed};
+  pcg_extras::seed_seq_from<std::random_device> random_seed;
+  pcg32 rng{random_seed};
+  if (seed) {
+    rng.seed(seed);
+  }
 #else
-    srand(time(NULL));
+    srand(seed ? seed : time(NULL));
 #endif
-  Algorithm engine(anchor_set, working_set);
+  /*
+   * Weighted engines get the weight pattern repeated over the buckets,
+   * every other engine has uniform weights
+   */
+  constexpr bool weighted{
+      requires(Algorithm &e) { e.setWeight(0u, 1u); }};
+  std::vector<uint32_t> bucket_weight(anchor_set, 1);
+  if (weighted && !weights.empty()) {
+    for (uint32_t i = 0; i < anchor_set; i++) {
+      bucket_weight[i] = weights[i % weights.size()];
+    }
+  }
+  auto engine = [&] {
+    if constexpr (weighted) {
+      return Algorithm(
+          anchor_set, working_set,
+          *std::max_element(bucket_weight.begin(), bucket_weight.end()));
+    } else {
+      return Algorithm(anchor_set, working_set);
+    }
+  }();
+  if constexpr (weighted) {
+    for (uint32_t i = 0; i < anchor_set; i++) {
+      engine.setWeight(i, bucket_weight[i]);
+    }
+  }
+  if constexpr (requires { engine.setEpsilon(epsilon); }) {
+    engine.setEpsilon(epsilon);
+  }
+  if constexpr (requires { engine.setExpectedKeys(num_keys); }) {
+    engine.setExpectedKeys(num_keys);
+  }
+  /* Bounded engines place the keys, the others look them up */
+  auto place = [&engine](uint64_t key, uint64_t seed) {
+    if constexpr (requires { engine.place(key, seed); }) {
+      return engine.place(key, seed);
+    } else {
+      return engine.getBucketCRC32c(key, seed);
+    }
+  };
 
   // for lb
-  uint32_t *anchor_ansorbed_keys = new uint32_t[anchor_set]();
+  std::vector<uint64_t> anchor_ansorbed_keys(anchor_set);
 
   // random removals
   uint32_t *bucket_status = new uint32_t[anchor_set]();
@@ -73,26 +172,119 @@ int bench(const std::string_view name, const std::string &filename,
   std::ofstream results_file;
   results_file.open(filename, std::ofstream::out | std::ofstream::app);
 
+  std::optional<PerfCounters> counters;
+  if (options.perf && threads == 1) {
+    counters.emplace();
+  }
+
   ////////////////////////////////////////////////////////////////////
-  for (uint32_t i = 0; i < num_keys; ++i) {
+  if (key_source == "rand" && threads == 1) {
+    if (counters) {
+      counters->start();
+    }
+    for (uint64_t i = 0; i < num_keys; ++i) {
 #ifdef USE_PCG32
-    anchor_ansorbed_keys[engine.getBucketCRC32c(rng(), rng())] += 1;
+      anchor_ansorbed_keys[place(rng(), rng())] += 1;
 #else
-    anchor_ansorbed_keys[engine.getBucketCRC32c(rand(), rand())] += 1;
+      anchor_ansorbed_keys[place(rand(), rand())] += 1;
 #endif
+    }
+    if (counters) {
+      counters->stop();
+    }
+  } else {
+    /*
+     * Every thread draws its share of the keys from its own source (rand()
+     * is replaced by the uniform source) in chunks to bound the memory,
+     * and counts them in its own array; arrays are merged at the end.
+     */
+    const auto spec = key_source == "rand" ? std::string{"uniform"} : key_source;
+    std::vector<std::vector<uint64_t>> partial(threads);
+    auto count = [&](uint32_t t) {
+      pin_to_core(t);
+      auto &absorbed = partial[t];
+      absorbed.assign(anchor_set, 0);
+      KeySource source{spec, keyspace, seed ? seed + t : 0};
+      if (t == 0) {
+        fmt::println("Keys: {}, KeySpace: {}, Seed: {}, Threads: {}", spec,
+                     keyspace, source.seed(), threads);
+      }
+      const auto n = num_keys / threads + (t < num_keys % threads);
+      std::vector<Key> keys(std::min<uint64_t>(n, 1u << 20));
+      for (uint64_t i = 0; i < n; i += keys.size()) {
+        auto m = std::min<uint64_t>(keys.size(), n - i);
+        source.fill(keys.data(), m);
+        if (counters) {
+          counters->start();
+        }
+        for (size_t k = 0; k < m; ++k) {
+          absorbed[place(keys[k].key, keys[k].seed)] += 1;
+        }
+        if (counters) {
+          counters->stop();
+        }
+      }
+    };
+    if (threads == 1) {
+      count(0);
+    } else {
+      std::vector<std::thread> workers;
+      for (uint32_t t = 0; t < threads; ++t) {
+        workers.emplace_back(count, t);
+      }
+      for (auto &w : workers) {
+        w.join();
+      }
+    }
+    for (const auto &absorbed : partial) {
+      for (uint32_t i = 0; i < anchor_set; ++i) {
+        anchor_ansorbed_keys[i] += absorbed[i];
+      }
+    }
+  }
+  if (counters) {
+    fmt::println("{}: Per lookup{}: {}", name,
+                 key_source == "rand" ? " (including rand())" : "",
+                 counters->report(num_keys));
+  } else if (options.perf) {
+    fmt::println("{}: Performance counters require a single thread", name);
   }
 
-  // check load balancing
-  double mean = (double)num_keys / (working_set - num_removals);
+  // check load balancing (each bucket against its weight-proportional target)
+  double total_weight = 0;
+  uint32_t working = 0;
+  for (uint32_t i = 0; i < anchor_set; i++) {
+    if (bucket_status[i]) {
+      total_weight += bucket_weight[i];
+      ++working;
+    }
+  }
+  double mean = (double)num_keys / total_weight;
 
+  /*
+   * lb is the maximum of load/target, the deviation is measured in keys
+   * and the coefficient of variation on load/target. chi2 tests the
+   * counts against the targets (meaningful for distinct independent keys).
+   */
   double lb = 0;
+  double squared_deviation = 0;
+  double squared_relative = 0;
+  double chi2 = 0;
+  std::vector<uint32_t> working_buckets;
+  working_buckets.reserve(working);
   for (uint32_t i = 0; i < anchor_set; i++) {
 
     if (bucket_status[i]) {
 
-      if (anchor_ansorbed_keys[i] / mean > lb) {
-        lb = anchor_ansorbed_keys[i] / mean;
+      auto target = mean * bucket_weight[i];
+      auto load = static_cast<double>(anchor_ansorbed_keys[i]);
+      if (load / target > lb) {
+        lb = load / target;
       }
+      squared_deviation += (load - target) * (load - target);
+      squared_relative += (load / target - 1.0) * (load / target - 1.0);
+      chi2 += (load - target) * (load - target) / target;
+      working_buckets.push_back(i);
 
     }
 
@@ -102,49 +294,129 @@ int bench(const std::string_view name, const std::string &filename,
       }
     }
   }
+  auto relative = [&](uint32_t b) {
+    return anchor_ansorbed_keys[b] / (mean * bucket_weight[b]);
+  };
+  double stddev = std::sqrt(squared_deviation / std::max(working, 1u));
+  double cv = std::sqrt(squared_relative / std::max(working, 1u));
+  double pvalue = chi_square_pvalue(chi2, working - 1.0);
 
+  // most loaded buckets
+  auto top = std::min<size_t>(options.top, working_buckets.size());
+  std::partial_sort(working_buckets.begin(), working_buckets.begin() + top,
+                    working_buckets.end(), [&](uint32_t a, uint32_t b) {
+                      return relative(a) > relative(b);
+                    });
+  std::string top_buckets;
+  for (size_t i = 0; i < top; ++i) {
+    top_buckets += fmt::format("{}{}:{}({:.4f})", i ? " " : "",
+                               working_buckets[i],
+                               anchor_ansorbed_keys[working_buckets[i]],
+                               relative(working_buckets[i]));
+  }
+
+  // histogram of load/target over [min,max]
+  std::string histogram;
+  if (working && options.bins) {
+    auto [lo, hi] = std::minmax_element(
+        working_buckets.begin(), working_buckets.end(),
+        [&](uint32_t a, uint32_t b) { return relative(a) < relative(b); });
+    auto min = relative(*lo);
+    auto width = std::max(relative(*hi) - min, 1e-9) / options.bins;
+    std::vector<uint32_t> bins(options.bins);
+    for (auto b : working_buckets) {
+      auto bin = static_cast<uint32_t>((relative(b) - min) / width);
+      bins[std::min(bin, options.bins - 1)] += 1;
+    }
+    for (uint32_t i = 0; i < options.bins; ++i) {
+      histogram += fmt::format("{}[{:.4f},{:.4f}):{}", i ? " " : "",
+                               min + i * width, min + (i + 1) * width,
+                               bins[i]);
+    }
+  }
 
   // print lb res
+  auto statistics = fmt::format(
+      "\tStdDev\t{}\tCV\t{}\tChi2\t{}\tPValue\t{}", stddev, cv, chi2,
+      pvalue);
 #ifdef USE_PCG32
   fmt::println("{}: LB is {}\n", name, lb);
   results_file << name << ": "
-               << "Balance: " << lb << "\tPCG32\n";
+               << "Balance: " << lb << "\tPCG32" << statistics << "\n";
 #else
   fmt::println("{}: LB is {}\n", name, lb);
   results_file << name << ": "
-               << "Balance: " << lb << "\trand()\n";
+               << "Balance: " << lb << "\trand()" << statistics << "\n";
 #endif
+  fmt::println("{}: StdDev is {} keys, CV is {}, Chi2 is {} ({} degrees of "
+               "freedom, p-value {})",
+               name, stddev, cv, chi2, working - 1, pvalue);
+  fmt::println("{}: Top {} buckets (bucket:keys(load/target)): {}", name, top,
+               top_buckets);
+  fmt::println("{}: Histogram of load/target: {}", name, histogram);
 
   ////////////////////////////////////////////////////////////////////
 
   results_file.close();
 
   delete[] bucket_status;
-  delete[] anchor_ansorbed_keys;
 
   return 0;
 }
 
+/*
+ * The algorithms of the benchmark
+ */
+using Algorithms =
+    Engines::With<WeightedEngine<MementoEngine<boost::unordered_flat_map>>,
+                  WeightedEngine<AnchorEngine>,
+                  BoundedLoadEngine<MementoEngine<boost::unordered_flat_map>>,
+                  BoundedLoadEngine<AnchorEngine>>;
+
 int main(int argc, char *argv[]) {
   cxxopts::Options options("speed_test", "MementoHash vs AnchorHash benchmark");
   options.add_options()(
       "Algorithm",
-      "Algorithm (null|baseline|anchor|memento|mementoboost|mementomash|mementostd|mementogtl|jump|power)",
+      "Algorithm (null|baseline|" + Algorithms::names() + ")",
       cxxopts::value<std::string>())(
       "AnchorSet", "Size of the AnchorSet (ignored by Memento)",
       cxxopts::value<int>())("WorkingSet", "Size of the WorkingSet",
                              cxxopts::value<int>())(
       "NumRemovals", "Number of random removals", cxxopts::value<int>())(
       "NumKeys", "Number of keys to lookup for",
-      cxxopts::value<int>())("ResFileName", "Number of keys to lookup for",
-                             cxxopts::value<std::string>());
+      cxxopts::value<uint64_t>())("ResFileName", "Number of keys to lookup for",
+                             cxxopts::value<std::string>())(
+      "weights",
+      "Comma separated bucket weights, repeated over the buckets "
+      "(weighted algorithms only)",
+      cxxopts::value<std::string>()->default_value(""))(
+      "epsilon", "Allowed overload (bounded algorithms only)",
+      cxxopts::value<double>()->default_value("0.25"))(
+      "keys", "Key source (rand|uniform|zipf:S|hotspot:F:P|sequential)",
+      cxxopts::value<std::string>()->default_value("rand"))(
+      "keyspace", "Number of distinct keys (zipf and hotspot)",
+      cxxopts::value<int>()->default_value("1000000"))(
+      "seed", "Seed for keys and removals (0 means random)",
+      cxxopts::value<uint64_t>()->default_value("0"))(
+      "perf",
+      "Read hardware performance counters around the lookups and report "
+      "them per lookup (single thread only)",
+      cxxopts::value<bool>()->default_value("false"))(
+      "threads",
+      "Number of threads counting the keys (with more than one thread rand "
+      "keys are replaced by uniform keys)",
+      cxxopts::value<int>()->default_value("1"))(
+      "top", "Number of most loaded buckets to report",
+      cxxopts::value<int>()->default_value("10"))(
+      "bins", "Number of bins of the load histogram",
+      cxxopts::value<int>()->default_value("20"));
 
   options.positional_help(
       "Algorithm AnchorSet WorkingSet NumRemovals Numkeys ResFilename");
   options.parse_positional({"Algorithm", "AnchorSet", "WorkingSet",
                             "NumRemovals", "NumKeys", "ResFileName"});
   auto result = options.parse(argc, argv);
-  if (argc != 7) {
+  if (!result.count("ResFileName")) {
     fmt::println("{}", options.help());
     exit(1);
   }
@@ -153,8 +425,30 @@ int main(int argc, char *argv[]) {
   auto anchor_set = static_cast<uint32_t>(result["AnchorSet"].as<int>());
   auto working_set = static_cast<uint32_t>(result["WorkingSet"].as<int>());
   auto num_removals = static_cast<uint32_t>(result["NumRemovals"].as<int>());
-  auto num_keys = static_cast<uint32_t>(result["NumKeys"].as<int>());
+  auto num_keys = result["NumKeys"].as<uint64_t>();
   auto filename = result["ResFileName"].as<std::string>();
+  auto weights = parsePositiveList(result["weights"].as<std::string>());
+  auto epsilon = result["epsilon"].as<double>();
+  auto key_source = result["keys"].as<std::string>();
+  auto keyspace = static_cast<uint32_t>(result["keyspace"].as<int>());
+  auto seed = result["seed"].as<uint64_t>();
+  auto perf = result["perf"].as<bool>();
+  auto threads = static_cast<uint32_t>(result["threads"].as<int>());
+  BalanceOptions balance_options{
+      .filename = filename,
+      .anchor_set = anchor_set,
+      .working_set = working_set,
+      .num_removals = num_removals,
+      .num_keys = num_keys,
+      .weights = weights,
+      .epsilon = epsilon,
+      .key_source = key_source,
+      .keyspace = keyspace,
+      .seed = seed,
+      .perf = perf,
+      .threads = threads ? threads : std::thread::hardware_concurrency(),
+      .top = static_cast<uint32_t>(result["top"].as<int>()),
+      .bins = static_cast<uint32_t>(result["bins"].as<int>())};
 
   fmt::println("Algorithm: {}, AnchorSet: {}, WorkingSet: {}, NumRemovals: {}, "
                "NumKeys: {}, ResFileName: {}",
@@ -181,39 +475,10 @@ int main(int argc, char *argv[]) {
       }
     }
     delete[] bucket_status;
-  } else if (algorithm == "anchor") {
-    return bench<AnchorEngine>("Anchor", filename, anchor_set, working_set,
-                               num_removals, num_keys);
-  } else if (algorithm == "memento") {
-    return bench<MementoEngine<boost::unordered_flat_map>>(
-        "Memento<boost::unordered_flat_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementoboost") {
-    return bench<MementoEngine<boost::unordered_map>>(
-        "Memento<boost::unordered_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementostd") {
-    return bench<MementoEngine<std::unordered_map>>(
-        "Memento<std::unordered_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementogtl") {
-      return bench<MementoEngine<gtl::flat_hash_map>>(
-          "Memento<std::gtl::flat_hash_map>", filename, anchor_set, working_set,
-          num_removals, num_keys);
-  } else if (algorithm == "mementomash") {
-    return bench<MementoEngine<MashTable>>("Memento<MashTable>", filename,
-                                           anchor_set, working_set,
-                                           num_removals, num_keys);
-  } else if (algorithm == "jump") {
-      return bench<JumpEngine>("JumpEngine", filename,
-                               anchor_set, working_set,
-                               num_removals, num_keys);
-  } else if (algorithm == "power") {
-      return bench<PowerEngine>("PowerEngine", filename,
-                               anchor_set, working_set,
-                               num_removals, num_keys);
   } else {
-    fmt::println("Unknown algorithm {}", algorithm);
-    return 2;
+    return Algorithms::dispatch(
+        algorithm, [&]<typename Algorithm>(const std::string &name) {
+          return bench<Algorithm>(name, balance_options);
+        });
   }
 }
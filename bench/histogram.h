@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+/**
+ * A log-bucketed histogram of latencies (HDR style).
+ *
+ * Values below 2^SubBits have their own bucket, larger values are grouped
+ * by power of two, and each power of two is split into 2^SubBits linear
+ * sub-buckets: the relative error of a reported value is below 2^-SubBits
+ * over the whole 64-bit range, with a fixed number of counters.
+ *
+ * @tparam SubBits the number of bits of precision (5 means 3.2% error)
+ */
+template <uint32_t SubBits = 5> class LogHistogram final {
+  static constexpr uint32_t SUB = 1u << SubBits;
+  static constexpr uint32_t BUCKETS = SUB + (64 - SubBits) * SUB;
+
+public:
+  /**
+   * Records a value.
+   *
+   * @param value the value (e.g. nanoseconds)
+   */
+  void record(uint64_t value) noexcept {
+    ++m_counts[index(value)];
+    ++m_count;
+    m_sum += value;
+    m_min = std::min(m_min, value);
+    m_max = std::max(m_max, value);
+  }
+
+  /**
+   * Adds the values recorded by another histogram.
+   *
+   * @param other the other histogram
+   */
+  void merge(const LogHistogram &other) noexcept {
+    for (uint32_t i = 0; i < BUCKETS; ++i) {
+      m_counts[i] += other.m_counts[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    m_min = std::min(m_min, other.m_min);
+    m_max = std::max(m_max, other.m_max);
+  }
+
+  /**
+   * Returns the value below which the given percentage of the values fall
+   * (the upper bound of the bucket, and never more than the maximum).
+   *
+   * @param p the percentile in [0,100]
+   * @return the value at the percentile
+   */
+  uint64_t percentile(double p) const noexcept {
+    if (m_count == 0) {
+      return 0;
+    }
+    auto rank = static_cast<uint64_t>(std::ceil(p / 100.0 * m_count));
+    rank = std::clamp<uint64_t>(rank, 1, m_count);
+    uint64_t seen{0};
+    for (uint32_t i = 0; i < BUCKETS; ++i) {
+      seen += m_counts[i];
+      if (seen >= rank) {
+        return std::clamp(upper(i), m_min, m_max);
+      }
+    }
+    return m_max;
+  }
+
+  /**
+   * Returns the number of recorded values.
+   *
+   * @return the number of values
+   */
+  uint64_t count() const noexcept { return m_count; }
+
+  /**
+   * Returns the smallest recorded value.
+   *
+   * @return the minimum (0 if empty)
+   */
+  uint64_t min() const noexcept { return m_count ? m_min : 0; }
+
+  /**
+   * Returns the largest recorded value.
+   *
+   * @return the maximum
+   */
+  uint64_t max() const noexcept { return m_max; }
+
+  /**
+   * Returns the average of the recorded values.
+   *
+   * @return the mean (0 if empty)
+   */
+  double mean() const noexcept {
+    return m_count ? static_cast<double>(m_sum) / m_count : 0.0;
+  }
+
+  /**
+   * Writes the non-empty buckets as CSV rows:
+   * prefix,lower,upper,count,cumulative fraction
+   *
+   * @param out the output stream
+   * @param prefix the leading columns of each row (without the comma)
+   */
+  void writeCsv(std::ostream &out, std::string_view prefix) const {
+    uint64_t seen{0};
+    for (uint32_t i = 0; i < BUCKETS; ++i) {
+      if (m_counts[i] == 0) {
+        continue;
+      }
+      seen += m_counts[i];
+      out << prefix << ',' << lower(i) << ',' << upper(i) << ','
+          << m_counts[i] << ',' << static_cast<double>(seen) / m_count << '\n';
+    }
+  }
+
+private:
+  static uint32_t index(uint64_t value) noexcept {
+    if (value < SUB) {
+      return static_cast<uint32_t>(value);
+    }
+    const uint32_t exponent = std::bit_width(value) - 1;
+    const uint32_t shift = exponent - SubBits;
+    return SUB + shift * SUB + static_cast<uint32_t>(value >> shift) - SUB;
+  }
+
+  static uint64_t lower(uint32_t i) noexcept {
+    if (i < SUB) {
+      return i;
+    }
+    const uint32_t shift = (i - SUB) / SUB;
+    return static_cast<uint64_t>(SUB + (i - SUB) % SUB) << shift;
+  }
+
+  static uint64_t upper(uint32_t i) noexcept {
+    if (i < SUB) {
+      return i;
+    }
+    return lower(i) + ((uint64_t{1} << ((i - SUB) / SUB)) - 1);
+  }
+
+  std::array<uint64_t, BUCKETS> m_counts{};
+  uint64_t m_count{0};
+  uint64_t m_sum{0};
+  uint64_t m_min{UINT64_MAX};
+  uint64_t m_max{0};
+};
+
+using LatencyHistogram = LogHistogram<>;
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KEYSOURCE_H
+#define KEYSOURCE_H
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * A key as passed to getBucketCRC32c(key, seed)
+ */
+struct Key final {
+  uint32_t key;
+  uint32_t seed;
+};
+
+/**
+ * Seedable key generators shared by the benchmark drivers.
+ *
+ * The source is described by a string:
+ *  - uniform          both key and seed uniformly random
+ *  - zipf:S           key ids in [0,keyspace) with Zipf(S) popularity
+ *  - hotspot:F:P      a fraction F of the key ids receives a probability P
+ *  - sequential       monotonic key ids 0, 1, 2, ...
+ *
+ * Key ids are scrambled with a bijective mixer (except for sequential keys),
+ * so that popular ids are not neighbours, and share the same seed.
+ */
+class KeySource final {
+public:
+  enum class Kind { Uniform, Zipf, Hotspot, Sequential };
+
+  /**
+   * Creates a new key source.
+   *
+   * @param spec      the description of the source (see above)
+   * @param keyspace  the number of distinct key ids (zipf and hotspot)
+   * @param seed      the seed of the generator (0 means random)
+   */
+  KeySource(const std::string &spec, uint32_t keyspace, uint64_t seed)
+      : m_keyspace{std::max(keyspace, 1u)},
+        m_seed{seed ? seed : std::random_device{}()}, m_rng(m_seed) {
+    auto args = split(spec);
+    if (args[0] == "uniform") {
+      m_kind = Kind::Uniform;
+    } else if (args[0] == "zipf") {
+      m_kind = Kind::Zipf;
+      auto s = args.size() > 1 ? std::stod(args[1]) : 1.0;
+      m_cdf.resize(m_keyspace);
+      double sum{0};
+      for (uint32_t i = 0; i < m_keyspace; ++i) {
+        sum += 1.0 / std::pow(i + 1.0, s);
+        m_cdf[i] = sum;
+      }
+      for (auto &c : m_cdf) {
+        c /= sum;
+      }
+    } else if (args[0] == "hotspot") {
+      m_kind = Kind::Hotspot;
+      auto f = args.size() > 1 ? std::stod(args[1]) : 0.1;
+      m_hotProbability = args.size() > 2 ? std::stod(args[2]) : 0.9;
+      m_hot = std::clamp<uint32_t>(f * m_keyspace, 1, m_keyspace);
+    } else if (args[0] == "sequential") {
+      m_kind = Kind::Sequential;
+    } else {
+      throw std::invalid_argument{"Unknown key source " + spec};
+    }
+    m_keySeed = static_cast<uint32_t>(m_rng());
+  }
+
+  /**
+   * Generates the next n keys.
+   *
+   * @param out the buffer receiving the keys (at least n elements)
+   * @param n the number of keys
+   */
+  void fill(Key *out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = next();
+    }
+  }
+
+  /**
+   * Generates the next n keys into a new buffer.
+   *
+   * @param n the number of keys
+   * @return the keys
+   */
+  std::vector<Key> generate(size_t n) {
+    std::vector<Key> keys(n);
+    fill(keys.data(), n);
+    return keys;
+  }
+
+  /**
+   * Returns the next key.
+   *
+   * @return the key
+   */
+  Key next() {
+    switch (m_kind) {
+    case Kind::Uniform:
+      return Key{static_cast<uint32_t>(m_rng()), static_cast<uint32_t>(m_rng())};
+    case Kind::Zipf: {
+      auto u = uniform();
+      uint32_t id = std::lower_bound(m_cdf.begin(), m_cdf.end(), u) -
+                    m_cdf.begin();
+      return Key{scramble(std::min(id, m_keyspace - 1)), m_keySeed};
+    }
+    case Kind::Hotspot: {
+      uint32_t id;
+      if (uniform() < m_hotProbability || m_hot == m_keyspace) {
+        id = static_cast<uint32_t>(uniform() * m_hot);
+      } else {
+        id = m_hot + static_cast<uint32_t>(uniform() * (m_keyspace - m_hot));
+      }
+      return Key{scramble(std::min(id, m_keyspace - 1)), m_keySeed};
+    }
+    case Kind::Sequential:
+    default:
+      return Key{m_sequence++, m_keySeed};
+    }
+  }
+
+  /**
+   * Returns the key with the given id (zipf and hotspot), whatever its
+   * popularity: ids 0 to distinctKeys() - 1 give distinct keys.
+   *
+   * @param id the key id
+   * @return the key
+   */
+  Key key(uint32_t id) const noexcept { return Key{scramble(id), m_keySeed}; }
+
+  /**
+   * Returns the number of distinct keys the source can produce.
+   *
+   * @return the number of distinct keys
+   */
+  uint64_t distinctKeys() const noexcept {
+    switch (m_kind) {
+    case Kind::Zipf:
+    case Kind::Hotspot:
+      return m_keyspace;
+    default:
+      return UINT64_MAX;
+    }
+  }
+
+  /**
+   * Returns the seed of the generator (useful to repeat a run).
+   *
+   * @return the seed
+   */
+  uint64_t seed() const noexcept { return m_seed; }
+
+private:
+  static std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    size_t start{0};
+    for (;;) {
+      auto end = s.find(':', start);
+      parts.push_back(s.substr(start, end - start));
+      if (end == std::string::npos) {
+        return parts;
+      }
+      start = end + 1;
+    }
+  }
+
+  /* Bijective 32-bit mixer (lowbias32) */
+  static uint32_t scramble(uint32_t x) noexcept {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+  }
+
+  double uniform() { return (m_rng() >> 11) * 0x1.0p-53; }
+
+  Kind m_kind;
+  uint32_t m_keyspace;
+  uint64_t m_seed;
+  std::mt19937_64 m_rng;
+  uint32_t m_keySeed;
+  uint32_t m_sequence{0};
+  std::vector<double> m_cdf;
+  uint32_t m_hot{0};
+  double m_hotProbability{0};
+};
+
+/**
+ * Counter-based keys: the i-th key is a function of (seed, i) only, so that
+ * any range of keys can be regenerated (by any thread, in any order)
+ * without storing them. Keys are splitmix64 outputs, which is a bijection
+ * of the counter: the first 2^64 keys are distinct.
+ */
+class CounterKeys final {
+public:
+  /**
+   * Creates a new counter-based key generator.
+   *
+   * @param seed the seed of the generator (0 means random)
+   */
+  explicit CounterKeys(uint64_t seed)
+      : m_seed{seed ? seed : std::random_device{}()} {}
+
+  /**
+   * Returns the key with the given index.
+   *
+   * @param index the index of the key
+   * @return the key
+   */
+  Key operator[](uint64_t index) const noexcept {
+    auto x = m_seed + index * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return Key{static_cast<uint32_t>(x), static_cast<uint32_t>(x >> 32)};
+  }
+
+  /**
+   * Returns the seed of the generator (useful to repeat a run).
+   *
+   * @return the seed
+   */
+  uint64_t seed() const noexcept { return m_seed; }
+
+private:
+  uint64_t m_seed;
+};
+
+#endif // KEYSOURCE_H
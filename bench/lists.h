@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LISTS_H
+#define LISTS_H
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Splits a list given on the command line (e.g. "memento,anchor"), skipping
+ * empty items.
+ *
+ * @param s the list
+ * @param separator the separator of the items
+ * @return the items
+ */
+inline std::vector<std::string> splitList(const std::string &s,
+                                          char separator = ',') {
+  std::vector<std::string> items;
+  std::stringstream ss{s};
+  std::string item;
+  while (std::getline(ss, item, separator)) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+/**
+ * Parses a comma separated list of positive integers (e.g. the weights
+ * "1,2,4" or the thread counts "1,2,4,8"); 0 is read as 1.
+ *
+ * @param s the list
+ * @return the values
+ */
+inline std::vector<uint32_t> parsePositiveList(const std::string &s) {
+  std::vector<uint32_t> values;
+  for (const auto &item : splitList(s)) {
+    values.push_back(static_cast<uint32_t>(std::max(std::stoul(item), 1UL)));
+  }
+  return values;
+}
+
+#endif // LISTS_H
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+#include <array>
+#include <cstdint>
+#include <fmt/core.h>
+#include <optional>
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Hardware performance counters of the calling thread (Linux
+ * perf_event_open), user space only.
+ *
+ * Each event is opened on its own, so that the events that are not
+ * available (no PMU, virtual machines, perf_event_paranoid) are reported
+ * as unsupported while the others are still counted. Counts are scaled
+ * when the kernel multiplexes the counters.
+ *
+ * Counting is accumulated over every start/stop pair.
+ */
+class PerfCounters final {
+public:
+  enum Event {
+    Cycles,
+    Instructions,
+    L1DMisses,
+    LLCMisses,
+    DTLBMisses,
+    BranchMisses,
+    EVENTS
+  };
+
+  PerfCounters() {
+    m_fd.fill(-1);
+#ifdef __linux__
+    constexpr auto cache = [](uint64_t id) {
+      return id | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    open(Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    open(Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    open(L1DMisses, PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D));
+    open(LLCMisses, PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL));
+    open(DTLBMisses, PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_DTLB));
+    open(BranchMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (auto fd : m_fd) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif
+  }
+
+  /**
+   * Starts (or resumes) counting.
+   */
+  void start() noexcept {
+#ifdef __linux__
+    for (auto fd : m_fd) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  /**
+   * Stops counting and accumulates the counts since start.
+   */
+  void stop() noexcept {
+#ifdef __linux__
+    for (auto fd : m_fd) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+    for (int e = 0; e < EVENTS; ++e) {
+      /* value, time enabled, time running */
+      uint64_t data[3];
+      if (m_fd[e] < 0 || read(m_fd[e], data, sizeof(data)) != sizeof(data)) {
+        continue;
+      }
+      if (data[2] == 0) {
+        continue;
+      }
+      m_value[e] += static_cast<double>(data[0]) * data[1] / data[2];
+      m_counted[e] = true;
+    }
+#endif
+  }
+
+  /**
+   * Returns the accumulated count of an event.
+   *
+   * @param event the event
+   * @return the count, or nothing if the event is not supported
+   */
+  std::optional<double> value(Event event) const noexcept {
+    if (!m_counted[event]) {
+      return std::nullopt;
+    }
+    return m_value[event];
+  }
+
+  /**
+   * Returns true if at least one event could be opened.
+   *
+   * @return true if some counters are available
+   */
+  bool supported() const noexcept {
+    for (auto fd : m_fd) {
+      if (fd >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Formats the counts divided by the number of operations (lookups), e.g.
+   * "cycles 120.4, instructions 210.9, IPC 1.75, L1D-misses 2.1, ..."
+   *
+   * @param operations the number of operations in the measured region
+   * @return the report
+   */
+  std::string report(uint64_t operations) const {
+    static constexpr const char *names[EVENTS] = {
+        "cycles",     "instructions", "L1D-misses",
+        "LLC-misses", "dTLB-misses",  "branch-misses"};
+    std::string out;
+    for (int e = 0; e < EVENTS; ++e) {
+      out += e ? ", " : "";
+      out += names[e];
+      if (auto v = value(static_cast<Event>(e)); v && operations) {
+        out += fmt::format(" {:.3f}", *v / operations);
+      } else {
+        out += " unsupported";
+      }
+      if (e == Instructions) {
+        auto cycles = value(Cycles);
+        auto instructions = value(Instructions);
+        out += cycles && instructions && *cycles > 0
+                   ? fmt::format(", IPC {:.2f}", *instructions / *cycles)
+                   : ", IPC unsupported";
+      }
+    }
+    return out;
+  }
+
+private:
+#ifdef __linux__
+  void open(Event event, uint32_t type, uint64_t config) noexcept {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    m_fd[event] = static_cast<int>(
+        syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+#endif
+
+  std::array<int, EVENTS> m_fd;
+  std::array<double, EVENTS> m_value{};
+  std::array<bool, EVENTS> m_counted{};
+};
+
+#endif // PERFCOUNTERS_H
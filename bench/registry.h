@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef REGISTRY_H
+#define REGISTRY_H
+#include "../any/anyengine.h"
+#include <fmt/core.h>
+#include <string>
+#include <string_view>
+
+/**
+ * An engine a benchmark driver can run: one that maps keys or one that
+ * places them.
+ */
+template <typename Engine>
+concept RegisteredEngine =
+    ConsistentHashEngine<Engine> || PlacementEngine<Engine>;
+
+/* BasicAnyEngine of the engines, or void if some of them only place keys */
+template <typename... Algorithms> struct AnyOf final {
+  using type = void;
+};
+
+template <ConsistentHashEngine... Algorithms>
+struct AnyOf<Algorithms...> final {
+  using type = BasicAnyEngine<Algorithms...>;
+};
+
+/**
+ * The algorithms a benchmark driver can run, selected by name (see
+ * EngineName): dispatch calls a generic function with the engine type,
+ * e.g. [&]<typename Algorithm>(const std::string &label) { ... }.
+ *
+ * @tparam Algorithms the engines
+ */
+template <RegisteredEngine... Algorithms> struct Registry final {
+  /** The registry with more engines */
+  template <RegisteredEngine... More>
+  using With = Registry<Algorithms..., More...>;
+
+  /**
+   * An engine selected at run time among the algorithms (void if some of
+   * them only place keys)
+   */
+  using Any = typename AnyOf<Algorithms...>::type;
+
+  /**
+   * Calls f with the engine with the given name.
+   *
+   * @param algorithm the key of the engine
+   * @param f the generic function receiving the engine type and its label
+   * @return the result of f, 2 if no engine has the given name
+   */
+  template <typename F> static int dispatch(std::string_view algorithm, F &&f) {
+    int result{2};
+    const bool found = ((EngineName<Algorithms>::key() == algorithm &&
+                         (result = f.template operator()<Algorithms>(
+                              EngineName<Algorithms>::label()),
+                          true)) ||
+                        ...);
+    if (!found) {
+      fmt::println("Unknown algorithm {}", algorithm);
+    }
+    return result;
+  }
+
+  /**
+   * Returns the keys of the engines separated by '|'.
+   *
+   * @return the names of the engines
+   */
+  static std::string names() {
+    std::string out;
+    ((out += (out.empty() ? "" : "|") + EngineName<Algorithms>::key()), ...);
+    return out;
+  }
+};
+
+/**
+ * The engines shared by every driver.
+ */
+using Engines =
+    Registry<AnchorEngine, MementoEngine<boost::unordered_flat_map>,
+             MementoEngine<boost::unordered_map>,
+             MementoEngine<std::unordered_map>,
+             MementoEngine<gtl::flat_hash_map>, MementoEngine<MashTable>,
+             MementoEngine<boost::unordered_flat_map, PathCompression>,
+             MementoEngine<boost::unordered_flat_map, DigestRehash>,
+             BasicAnchorEngine<FastRange>,
+             MementoEngine<boost::unordered_flat_map, FastRange>,
+             JumpEngine, BasicJumpEngine<IntegerJump>, PowerEngine>;
+
+#endif // REGISTRY_H
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STATISTICS_H
+#define STATISTICS_H
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Summary of repeated measurements: the median and a distribution-free
+ * confidence interval of the median, from the order statistics.
+ */
+struct SampleSummary final {
+  size_t count{0};
+  double median{0};
+  /* Bounds of the confidence interval of the median */
+  double low{0};
+  double high{0};
+  double mean{0};
+  double min{0};
+  double max{0};
+  /* The actual coverage of [low,high] (at least the requested one) */
+  double coverage{0};
+};
+
+/**
+ * Summarizes repeated measurements. The confidence interval of the median
+ * is [x(k), x(n-k+1)] with the largest k such that the interval covers the
+ * median with the requested probability (Binomial(n, 1/2) ranks), so that
+ * it holds whatever the distribution of the measurements. With fewer than 6
+ * samples no such k exists at 95%: the interval is [min,max].
+ *
+ * @param samples the measurements
+ * @param confidence the confidence level of the interval
+ * @return the summary
+ */
+inline SampleSummary summarize(std::vector<double> samples,
+                               double confidence = 0.95) {
+  SampleSummary s;
+  s.count = samples.size();
+  if (samples.empty()) {
+    return s;
+  }
+  std::sort(samples.begin(), samples.end());
+  const auto n = samples.size();
+  s.min = samples.front();
+  s.max = samples.back();
+  s.median = n % 2 ? samples[n / 2]
+                   : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+  double sum{0};
+  for (auto x : samples) {
+    sum += x;
+  }
+  s.mean = sum / n;
+
+  /* P(B < k) for B ~ Binomial(n, 1/2), accumulated while it stays small */
+  const double tail{(1.0 - confidence) / 2.0};
+  double p{std::pow(0.5, static_cast<double>(n))};
+  double below{0};
+  size_t k{0};
+  for (size_t i = 0; i < n; ++i) {
+    if (below + p > tail) {
+      break;
+    }
+    below += p;
+    k = i + 1;
+    p = p * (n - i) / (i + 1);
+  }
+  if (k == 0) {
+    s.low = s.min;
+    s.high = s.max;
+    s.coverage = 1.0 - 2.0 * std::pow(0.5, static_cast<double>(n));
+  } else {
+    s.low = samples[k - 1];
+    s.high = samples[n - k];
+    s.coverage = 1.0 - 2.0 * below;
+  }
+  return s;
+}
+
+/**
+ * Two-sided Mann-Whitney U test of two samples (normal approximation with
+ * tie and continuity corrections): a small p-value means that one sample
+ * tends to be larger than the other.
+ *
+ * @param a the first sample
+ * @param b the second sample
+ * @return the p-value, 1 if a sample is empty
+ */
+inline double mannWhitneyP(const std::vector<double> &a,
+                           const std::vector<double> &b) {
+  const double n1 = a.size(), n2 = b.size();
+  if (a.empty() || b.empty()) {
+    return 1.0;
+  }
+  struct Value final {
+    double x;
+    bool first;
+  };
+  std::vector<Value> all;
+  all.reserve(a.size() + b.size());
+  for (auto x : a) {
+    all.push_back({x, true});
+  }
+  for (auto x : b) {
+    all.push_back({x, false});
+  }
+  std::sort(all.begin(), all.end(),
+            [](const Value &l, const Value &r) { return l.x < r.x; });
+
+  /* Sum of the ranks of the first sample, ties get the average rank */
+  double ranks{0};
+  double ties{0};
+  for (size_t i = 0; i < all.size();) {
+    auto j = i;
+    while (j < all.size() && all[j].x == all[i].x) {
+      ++j;
+    }
+    const double t = j - i;
+    const double rank = (i + 1 + j) / 2.0;
+    for (auto k = i; k < j; ++k) {
+      if (all[k].first) {
+        ranks += rank;
+      }
+    }
+    ties += t * t * t - t;
+    i = j;
+  }
+  const double n = n1 + n2;
+  const double u = ranks - n1 * (n1 + 1) / 2.0;
+  const double mean = n1 * n2 / 2.0;
+  const double variance =
+      n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1)));
+  if (variance <= 0) {
+    return 1.0;
+  }
+  const double z =
+      std::max(std::abs(u - mean) - 0.5, 0.0) / std::sqrt(variance);
+  return std::erfc(z / std::sqrt(2.0));
+}
+
+#endif // STATISTICS_H
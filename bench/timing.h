@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TIMING_H
+#define TIMING_H
+#include "keysource.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+/**
+ * Measures wall time with a steady clock.
+ */
+class Stopwatch final {
+public:
+  Stopwatch() : m_start{std::chrono::steady_clock::now()} {}
+
+  /**
+   * Restarts the measurement.
+   */
+  void restart() noexcept { m_start = std::chrono::steady_clock::now(); }
+
+  /**
+   * Returns the time elapsed since the start.
+   *
+   * @return the elapsed time in seconds
+   */
+  double seconds() const noexcept {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         m_start)
+        .count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point m_start;
+};
+
+/**
+ * Measures the time of a loop that reads the given keys and stores a value
+ * derived from each one, like the lookup loops but without the engine.
+ * The loop is repeated and the minimum is returned.
+ *
+ * @param keys the keys
+ * @param repetitions the number of repetitions
+ * @return the time of the empty loop in seconds
+ */
+[[gnu::noinline]] inline double
+empty_loop_seconds(const std::vector<Key> &keys, int repetitions = 5) {
+  volatile int64_t bucket{0};
+  double best{0};
+  for (int r = 0; r < repetitions; ++r) {
+    Stopwatch watch;
+    for (const auto &k : keys) {
+      bucket = k.key ^ k.seed;
+    }
+    auto elapsed = watch.seconds();
+    best = r == 0 ? elapsed : std::min(best, elapsed);
+  }
+  return best;
+}
+
+#endif // TIMING_H
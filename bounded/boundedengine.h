@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BOUNDEDENGINE_H
+#define BOUNDEDENGINE_H
+#include "../hash/crc32c.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Consistent hashing with bounded loads (Mirrokni, Thorup, Zadimoghaddam)
+ * on top of any engine (MementoEngine, AnchorEngine, ...).
+ *
+ * Every bucket has a load counter and a capacity of
+ * ceil((1+epsilon) * keys / size) keys, where keys is the number of keys
+ * expected in the batch (setExpectedKeys) or, if unknown, the number of
+ * keys currently placed plus one. place() puts a key on the first candidate bucket
+ * that is below capacity: candidates are obtained by asking the engine again
+ * with a seed derived from the previous one, so the sequence is
+ * deterministic. lookup() walks the same candidates without placing the key,
+ * so it tells where a key would go now, not where it was placed: callers keep
+ * the bucket returned by place().
+ *
+ * Counters are updated with compare-and-swap and each one lives in its own
+ * cache line, so concurrent placements on different buckets do not contend.
+ * The number of placed keys is counted per thread (in SHARDS cache lines)
+ * and only summed to compute the capacity when no batch size is given.
+ * Membership changes (addBucket/removeBucket) must not run concurrently
+ * with placements.
+ */
+template <typename Engine> class BoundedLoadEngine final {
+  /* Maximum number of candidates before giving up on the bound */
+  static constexpr uint32_t MAX_ATTEMPTS = 1024;
+  /* Number of per-thread counters of the placed keys */
+  static constexpr uint32_t SHARDS = 64;
+
+  struct alignas(64) Counter final {
+    std::atomic<uint64_t> m_load{0};
+  };
+
+  struct alignas(64) Shard final {
+    /* Keys placed minus keys released by the threads of the shard */
+    std::atomic<int64_t> m_keys{0};
+  };
+
+public:
+  /**
+   * Creates a new bounded load engine.
+   *
+   * @param anchor_set    size of the anchor set (forwarded to the engine)
+   * @param working_set   initial number of working buckets
+   * @param epsilon       the allowed overload (0 < epsilon)
+   */
+  BoundedLoadEngine(uint32_t anchor_set, uint32_t working_set,
+                    double epsilon = 0.25)
+      : m_engine{anchor_set, working_set}, m_size{working_set},
+        m_length{std::max(anchor_set, working_set)},
+        m_counters{new Counter[m_length]}, m_epsilon{epsilon} {}
+
+  /**
+   * Places a key and returns its bucket: the load of the bucket is
+   * incremented, release must be called when the key goes away.
+   *
+   * @param key the key to place
+   * @param seed the initial seed for CRC32c
+   * @return the bucket of the key
+   */
+  uint32_t place(uint64_t key, uint64_t seed) noexcept {
+    const auto limit = capacity();
+    uint32_t b{0};
+    for (uint32_t attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
+      b = m_engine.getBucketCRC32c(key, seed);
+      auto &load = m_counters[b].m_load;
+      auto current = load.load(std::memory_order_relaxed);
+      while (current < limit) {
+        if (load.compare_exchange_weak(current, current + 1,
+                                       std::memory_order_relaxed)) {
+          count(1);
+          return b;
+        }
+      }
+      seed = crc32c_sse42_u64(seed, key);
+    }
+    /* Every candidate was full: keep the last one */
+    m_counters[b].m_load.fetch_add(1, std::memory_order_relaxed);
+    count(1);
+    return b;
+  }
+
+  /**
+   * Releases a key previously placed on the given bucket.
+   *
+   * @param bucket the bucket of the key
+   */
+  void release(uint32_t bucket) noexcept {
+    m_counters[bucket].m_load.fetch_sub(1, std::memory_order_relaxed);
+    count(-1);
+  }
+
+  /**
+   * Returns the bucket where place() would put a key with the current loads,
+   * without placing it. Repeated calls do not change the loads.
+   * <p>
+   * This is not the bucket of a key placed before: once other keys are
+   * placed or released, the first candidate below capacity may differ. The
+   * engine does not record the placements (that would cost memory per key),
+   * so the caller keeps the bucket returned by place(), and the engine has
+   * no getBucketCRC32c.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the bucket where the key would be placed
+   */
+  uint32_t lookup(uint64_t key, uint64_t seed) const noexcept {
+    const auto limit = capacity();
+    uint32_t b{0};
+    for (uint32_t attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
+      b = m_engine.getBucketCRC32c(key, seed);
+      if (load(b) < limit) {
+        return b;
+      }
+      seed = crc32c_sse42_u64(seed, key);
+    }
+    return b;
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() {
+    auto b = m_engine.addBucket();
+    if (b >= m_length) {
+      auto length{std::max(b + 1, m_length << 1)};
+      std::unique_ptr<Counter[]> counters{new Counter[length]};
+      for (uint32_t i = 0; i < m_length; ++i) {
+        counters[i].m_load.store(m_counters[i].m_load.load());
+      }
+      m_counters = std::move(counters);
+      m_length = length;
+    }
+    ++m_size;
+    return b;
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   * The keys placed on the bucket are forgotten and must be placed again.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) noexcept {
+    auto b = m_engine.removeBucket(bucket);
+    count(-static_cast<int64_t>(m_counters[b].m_load.exchange(0)));
+    --m_size;
+    return b;
+  }
+
+  /**
+   * Changes the allowed overload.
+   *
+   * @param epsilon the allowed overload (0 < epsilon)
+   */
+  void setEpsilon(double epsilon) noexcept { m_epsilon = epsilon; }
+
+  /**
+   * Sets the number of keys expected in the current batch: the capacity is
+   * derived from it instead of the number of keys placed (0 goes back to
+   * the number of keys placed).
+   *
+   * @param keys the number of keys expected
+   */
+  void setExpectedKeys(uint64_t keys) noexcept { m_expected = keys; }
+
+  /**
+   * Returns the number of keys placed on a bucket.
+   *
+   * @param bucket the bucket
+   * @return the load of the bucket
+   */
+  uint64_t load(uint32_t bucket) const noexcept {
+    return m_counters[bucket].m_load.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns the number of keys currently placed.
+   *
+   * @return the sum of the per-thread counters
+   */
+  uint64_t placed() const noexcept {
+    int64_t total{0};
+    const auto n = std::min(s_threads.load(std::memory_order_relaxed), SHARDS);
+    for (uint32_t i = 0; i < n; ++i) {
+      total += m_placed[i].m_keys.load(std::memory_order_relaxed);
+    }
+    return static_cast<uint64_t>(std::max<int64_t>(total, 0));
+  }
+
+  /**
+   * Returns the current capacity of each bucket.
+   *
+   * @return the maximum number of keys a bucket may hold
+   */
+  uint64_t capacity() const noexcept {
+    const auto keys = m_expected ? m_expected : placed() + 1;
+    return static_cast<uint64_t>(
+        std::ceil((1.0 + m_epsilon) * static_cast<double>(keys) / m_size));
+  }
+
+private:
+  /*
+   * Counts placed (positive) or released (negative) keys in the shard of
+   * the calling thread
+   */
+  void count(int64_t keys) noexcept {
+    static thread_local const uint32_t shard =
+        s_threads.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    m_placed[shard].m_keys.fetch_add(keys, std::memory_order_relaxed);
+  }
+
+  /* Threads that have placed keys (with any engine of this type) */
+  static inline std::atomic<uint32_t> s_threads{0};
+
+  Engine m_engine;
+  uint32_t m_size;
+  uint32_t m_length;
+  std::unique_ptr<Counter[]> m_counters;
+  Shard m_placed[SHARDS];
+  uint64_t m_expected{0};
+  double m_epsilon;
+};
+
+#endif // BOUNDEDENGINE_H
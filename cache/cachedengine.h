@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CACHEDENGINE_H
+#define CACHEDENGINE_H
+#include <cstdint>
+#include <memory>
+
+/**
+ * A small 2-way set associative key->bucket cache in front of any engine.
+ *
+ * Entries are tagged with an epoch that is incremented by addBucket and
+ * removeBucket, so entries computed before a membership change are
+ * treated as misses and never returned. The cache is not thread-safe.
+ *
+ * @tparam Engine the wrapped engine
+ * @tparam Sets   the number of sets (a power of 2), each holding 2 entries
+ */
+template <typename Engine, uint32_t Sets = 4096> class CachedEngine final {
+  static_assert((Sets & (Sets - 1)) == 0, "Sets must be a power of 2");
+
+  struct Entry final {
+    uint64_t m_key;
+    uint64_t m_seed;
+    uint32_t m_bucket;
+    uint32_t m_epoch;
+  };
+
+  struct alignas(64) Set final {
+    Entry m_entry[2];
+    /* The entry to replace on the next miss */
+    uint32_t m_victim;
+  };
+
+public:
+  CachedEngine(uint32_t anchor_set, uint32_t working_set)
+      : m_engine{anchor_set, working_set}, m_sets{new Set[Sets]()} {}
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) noexcept {
+    auto &set = m_sets[index(key, seed)];
+    for (uint32_t i = 0; i < 2; ++i) {
+      const auto &e = set.m_entry[i];
+      if (e.m_epoch == m_epoch && e.m_key == key && e.m_seed == seed) {
+        set.m_victim = i ^ 1;
+        ++m_hits;
+        return e.m_bucket;
+      }
+    }
+    ++m_misses;
+    const auto b = m_engine.getBucketCRC32c(key, seed);
+    set.m_entry[set.m_victim] = Entry{key, seed, b, m_epoch};
+    set.m_victim ^= 1;
+    return b;
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() noexcept {
+    invalidate();
+    return m_engine.addBucket();
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) noexcept {
+    invalidate();
+    return m_engine.removeBucket(bucket);
+  }
+
+  /**
+   * Returns the number of lookups answered by the cache.
+   *
+   * @return the number of hits
+   */
+  uint64_t hits() const noexcept { return m_hits; }
+
+  /**
+   * Returns the number of lookups forwarded to the engine.
+   *
+   * @return the number of misses
+   */
+  uint64_t misses() const noexcept { return m_misses; }
+
+private:
+  static uint32_t index(uint64_t key, uint64_t seed) noexcept {
+    auto x = (key ^ (seed * 0x9E3779B97F4A7C15ULL)) * 0xff51afd7ed558ccdULL;
+    return static_cast<uint32_t>(x >> 32) & (Sets - 1);
+  }
+
+  /*
+   * Entries are valid only if their epoch is the current one. Epoch 0 marks
+   * empty entries, and when the counter wraps around the cache is cleared.
+   */
+  void invalidate() noexcept {
+    if (++m_epoch == 0) {
+      for (uint32_t i = 0; i < Sets; ++i) {
+        m_sets[i] = Set{};
+      }
+      m_epoch = 1;
+    }
+  }
+
+  Engine m_engine;
+  std::unique_ptr<Set[]> m_sets;
+  uint32_t m_epoch{1};
+  uint64_t m_hits{0};
+  uint64_t m_misses{0};
+};
+
+#endif // CACHEDENGINE_H
@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "anchor/anchorengine.h"
+#include "bench/affinity.h"
+#include "bench/histogram.h"
+#include "bench/keysource.h"
+#include "bench/lists.h"
+#include "bench/registry.h"
+#include "bench/timing.h"
+#include "cache/cachedengine.h"
+#include "concurrent/syncengine.h"
+#include "jump/jumpengine.h"
+#include "memento/mashtable.h"
+#include "memento/mementoengine.h"
+#include "power/powerengine.h"
+#include "stats/heapstats.h"
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <boost/unordered/unordered_flat_map.hpp>
+#include <boost/unordered_map.hpp>
+#include <chrono>
+#include <cxxopts.hpp>
+#include <fmt/core.h>
+#include <fstream>
+#include <gtl/phmap.hpp>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * ******************************************
+ * Heap allocation measurement
+ * ******************************************
+ */
+
+#ifdef USE_HEAPSTATS
+/*
+ * Returns the number of bytes currently allocated
+ */
+long live_bytes() noexcept { return heapstats::snapshot().live; }
+#endif
+
+/*
+ * ******************************************
+ * Working set: the buckets currently in use, with O(1) random selection,
+ * insertion and removal
+ * ******************************************
+ */
+class WorkingSet final {
+public:
+  WorkingSet(uint32_t anchor_set, uint32_t working_set)
+      : m_position(std::max(anchor_set, working_set), UINT32_MAX) {
+    for (uint32_t b = 0; b < working_set; ++b) {
+      add(b);
+    }
+  }
+
+  void add(uint32_t bucket) {
+    if (bucket >= m_position.size()) {
+      m_position.resize(bucket + 1, UINT32_MAX);
+    }
+    m_position[bucket] = m_buckets.size();
+    m_buckets.push_back(bucket);
+  }
+
+  void remove(uint32_t bucket) {
+    auto p = m_position[bucket];
+    m_buckets[p] = m_buckets.back();
+    m_position[m_buckets[p]] = p;
+    m_buckets.pop_back();
+    m_position[bucket] = UINT32_MAX;
+  }
+
+  bool contains(uint32_t bucket) const noexcept {
+    return bucket < m_position.size() && m_position[bucket] != UINT32_MAX;
+  }
+
+  uint32_t at(uint32_t i) const noexcept { return m_buckets[i]; }
+
+  uint32_t size() const noexcept { return m_buckets.size(); }
+
+private:
+  std::vector<uint32_t> m_buckets;
+  std::vector<uint32_t> m_position;
+};
+
+/*
+ * ******************************************
+ * Churn parameters
+ * ******************************************
+ */
+struct ChurnOptions final {
+  std::string filename;
+  uint32_t anchor_set;
+  uint32_t working_set;
+  uint32_t num_updates;
+  uint32_t num_keys;
+  /* Probability that a membership change is a removal */
+  double remove_probability;
+  /* The working set never goes below this size */
+  uint32_t min_working;
+  /* Number of intervals of the throughput report */
+  uint32_t intervals;
+  std::string key_source;
+  uint32_t keyspace;
+  uint64_t seed;
+  /* Number of reader threads (0 runs lookups and updates in one thread) */
+  uint32_t readers;
+  /* Synchronization policies (mutex|shared|seqlock|rcu) */
+  std::vector<std::string> sync;
+  /* Pause of the writer between two updates */
+  uint32_t update_interval_us;
+  /* Readers time one lookup every latency_sample lookups */
+  uint32_t latency_sample;
+};
+
+/*
+ * Applies a random membership change and records its latency: removals
+ * pick a random working bucket, additions restore the bucket chosen by the
+ * engine. Returns false if the size limits allow no change.
+ */
+template <typename Algorithm>
+bool apply_update(Algorithm &engine, WorkingSet &working, std::mt19937_64 &rng,
+                  const ChurnOptions &options, uint32_t min_working,
+                  uint32_t max_working, LatencyHistogram &removals,
+                  LatencyHistogram &additions) {
+  std::uniform_real_distribution<double> coin{0.0, 1.0};
+  bool remove = working.size() > min_working &&
+                (working.size() >= max_working ||
+                 coin(rng) < options.remove_probability);
+  if (remove) {
+    auto b = working.at(rng() % working.size());
+    auto start{std::chrono::steady_clock::now()};
+    auto removed = engine.removeBucket(b);
+    auto end{std::chrono::steady_clock::now()};
+    removals.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    working.remove(removed);
+    return true;
+  }
+  if (working.size() < max_working) {
+    auto start{std::chrono::steady_clock::now()};
+    auto added = engine.addBucket();
+    auto end{std::chrono::steady_clock::now()};
+    additions.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    working.add(added);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Prints the latency distribution of the updates
+ */
+void print_updates(std::string_view name, std::string_view kind,
+                   const LatencyHistogram &h) {
+  fmt::println("{} {} latency (ns, {} updates): p50 {}, p99 {}, p99.9 {}, "
+               "max {}, mean {}",
+               name, kind, h.count(), h.percentile(50), h.percentile(99),
+               h.percentile(99.9), h.max(), h.mean());
+}
+
+/*
+ * ******************************************
+ * Churn routine: NumUpdates random membership changes, each followed by
+ * NumKeys/NumUpdates lookups. Removals pick a random working bucket,
+ * additions restore whatever bucket the engine chooses (the last removed
+ * one for Memento and Anchor).
+ * ******************************************
+ */
+template <typename Algorithm>
+int churn(const std::string_view name, const ChurnOptions &options) {
+  const auto anchor_set{options.anchor_set};
+  const auto working_set{options.working_set};
+  const auto num_updates{std::max(options.num_updates, 1u)};
+  const auto intervals{std::clamp(options.intervals, 1u, num_updates)};
+  const auto lookups_per_update{options.num_keys / num_updates};
+  /* Buckets above the anchor set cannot be added (Anchor) */
+  const auto max_working{std::max(anchor_set, working_set)};
+  const auto min_working{std::clamp(options.min_working, 1u, working_set)};
+
+  std::mt19937_64 rng{options.seed ? options.seed : std::random_device{}()};
+
+  /* Keys are generated once and reused in a circular fashion */
+  KeySource source{options.key_source, options.keyspace, options.seed};
+  auto keys{source.generate(std::clamp(options.num_keys, 1u, 1u << 20))};
+  fmt::println("Keys: {}, KeySpace: {}, Seed: {}", options.key_source,
+               options.keyspace, source.seed());
+
+  WorkingSet working{anchor_set, working_set};
+  LatencyHistogram removals;
+  LatencyHistogram additions;
+  std::vector<double> interval_rate;
+  std::vector<uint32_t> interval_size;
+  interval_rate.reserve(intervals + 1);
+  interval_size.reserve(intervals + 1);
+#ifdef USE_HEAPSTATS
+  std::vector<long> interval_heap;
+  interval_heap.reserve(intervals + 1);
+  long heap_max{0};
+  /* Only the memory of the engine is measured */
+  heapstats::resetPeak();
+  auto heap_start{live_bytes()};
+#endif
+  Algorithm engine(anchor_set, working_set);
+
+  volatile int64_t bucket{0};
+  size_t next_key{0};
+  uint64_t misplaced{0};
+  uint64_t interval_lookups{0};
+  double interval_seconds{0};
+  for (uint32_t u = 0; u < num_updates; ++u) {
+    /* Membership change */
+    apply_update(engine, working, rng, options, min_working, max_working,
+                 removals, additions);
+
+    /* Lookups */
+    const auto first_key{next_key};
+    Stopwatch watch;
+    for (uint32_t i = 0; i < lookups_per_update; ++i) {
+      const auto &k = keys[next_key];
+      next_key = next_key + 1 < keys.size() ? next_key + 1 : 0;
+      bucket = engine.getBucketCRC32c(k.key, k.seed);
+    }
+    interval_seconds += watch.seconds();
+    interval_lookups += lookups_per_update;
+    /*
+     * Every lookup must land on a working bucket: the same keys are looked
+     * up again outside the timed loop (the engine has not changed)
+     */
+    for (size_t i = 0, k = first_key; i < lookups_per_update; ++i) {
+      misplaced +=
+          !working.contains(engine.getBucketCRC32c(keys[k].key, keys[k].seed));
+      k = k + 1 < keys.size() ? k + 1 : 0;
+    }
+
+    if ((u + 1) % (num_updates / intervals) == 0 || u + 1 == num_updates) {
+      interval_rate.push_back(interval_seconds > 0
+                                  ? interval_lookups / interval_seconds / 1e6
+                                  : 0.0);
+      interval_size.push_back(working.size());
+#ifdef USE_HEAPSTATS
+      interval_heap.push_back(live_bytes() - heap_start);
+#endif
+      interval_lookups = 0;
+      interval_seconds = 0;
+    }
+  }
+
+  if (misplaced) {
+    fmt::println("{}: crazy bug! {} lookups returned a removed bucket", name,
+                 misplaced);
+  }
+
+  print_updates(name, "removeBucket", removals);
+  print_updates(name, "addBucket", additions);
+
+  std::string rates;
+  for (size_t i = 0; i < interval_rate.size(); ++i) {
+    rates += fmt::format("{}{:.3f}@{}", i ? " " : "", interval_rate[i],
+                         interval_size[i]);
+  }
+  fmt::println("{} Lookup rate over time (Mkeys/s@working buckets): {}", name,
+               rates);
+
+  std::ofstream results_file;
+  results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+  results_file << name << ":\tAnchor\t" << anchor_set << "\tWorking\t"
+               << working_set << "\tUpdates\t" << num_updates
+               << "\tLookupsPerUpdate\t" << lookups_per_update
+               << "\tRemoveP50\t" << removals.percentile(50) << "\tRemoveP99\t"
+               << removals.percentile(99) << "\tAddP50\t"
+               << additions.percentile(50) << "\tAddP99\t"
+               << additions.percentile(99) << "\tRates\t" << rates;
+#ifdef USE_HEAPSTATS
+  std::string heap;
+  for (size_t i = 0; i < interval_heap.size(); ++i) {
+    heap += fmt::format("{}{}", i ? " " : "", interval_heap[i]);
+  }
+  /* The peak includes the transient allocations within the updates */
+  heap_max = heapstats::snapshot().peak - heap_start;
+  fmt::println("{} Heap growth over time (bytes): {}, maximum is {} bytes, "
+               "peak RSS is {} bytes",
+               name, heap, heap_max, heapstats::peakRss());
+  results_file << "\tMaxHeapGrowth\t" << heap_max << "\tPeakRss\t"
+               << heapstats::peakRss();
+#endif
+  results_file << "\n";
+  results_file.close();
+
+  return misplaced ? 1 : 0;
+}
+
+/*
+ * ******************************************
+ * Concurrent churn routine: N reader threads look up keys until one writer
+ * thread has performed NumUpdates membership changes, with a pause of
+ * update_interval_us between two changes. Readers time one lookup every
+ * latency_sample lookups.
+ * ******************************************
+ */
+template <typename Concurrent>
+int churn_concurrent(const std::string_view name, const ChurnOptions &options) {
+  const auto anchor_set{options.anchor_set};
+  const auto working_set{options.working_set};
+  const auto num_updates{options.num_updates};
+  const auto readers{options.readers};
+  const auto max_working{std::max(anchor_set, working_set)};
+  const auto min_working{std::clamp(options.min_working, 1u, working_set)};
+  const auto sample_every{std::max(options.latency_sample, 1u)};
+
+  std::mt19937_64 rng{options.seed ? options.seed : std::random_device{}()};
+
+  /* Every reader cycles over its own keys */
+  std::vector<std::vector<Key>> keys(readers);
+  for (uint32_t t = 0; t < readers; ++t) {
+    KeySource source{options.key_source, options.keyspace,
+                     options.seed ? options.seed + t + 1 : 0};
+    keys[t] = source.generate(std::clamp(options.num_keys, 1u, 1u << 20));
+  }
+
+  Concurrent engine(anchor_set, working_set);
+  WorkingSet working{anchor_set, working_set};
+
+  struct alignas(64) Reader final {
+    LatencyHistogram latency;
+    uint64_t lookups{0};
+    double seconds{0};
+  };
+  std::vector<Reader> results(readers);
+  std::atomic<bool> done{false};
+  std::barrier start{readers + 1};
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < readers; ++t) {
+    threads.emplace_back([&, t] {
+      pin_to_core(t + 1);
+      auto &r = results[t];
+      const auto &k = keys[t];
+      volatile int64_t bucket{0};
+      size_t i{0};
+      start.arrive_and_wait();
+      Stopwatch watch;
+      while (!done.load(std::memory_order_relaxed)) {
+        const auto &key = k[i];
+        i = i + 1 < k.size() ? i + 1 : 0;
+        if (r.lookups++ % sample_every) {
+          bucket = engine.getBucketCRC32c(key.key, key.seed);
+          continue;
+        }
+        auto begin{std::chrono::steady_clock::now()};
+        bucket = engine.getBucketCRC32c(key.key, key.seed);
+        auto end{std::chrono::steady_clock::now()};
+        r.latency.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+                .count());
+      }
+      r.seconds = watch.seconds();
+    });
+  }
+
+  /* The writer runs in this thread */
+  LatencyHistogram removals;
+  LatencyHistogram additions;
+#ifdef USE_HEAPSTATS
+  /* Memory allocated by the updates, including the copies of the engine */
+  heapstats::resetPeak();
+  const auto heap_start{heapstats::snapshot()};
+#endif
+  pin_to_core(0);
+  start.arrive_and_wait();
+  Stopwatch watch;
+  for (uint32_t u = 0; u < num_updates; ++u) {
+    apply_update(engine, working, rng, options, min_working, max_working,
+                 removals, additions);
+    auto resume{std::chrono::steady_clock::now() +
+                std::chrono::microseconds(options.update_interval_us)};
+    while (std::chrono::steady_clock::now() < resume) {
+      std::this_thread::yield();
+    }
+  }
+  done.store(true, std::memory_order_relaxed);
+  auto writer_seconds{watch.seconds()};
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  LatencyHistogram latency;
+  uint64_t lookups{0};
+  double slowest{0};
+  for (const auto &r : results) {
+    latency.merge(r.latency);
+    lookups += r.lookups;
+    slowest = std::max(slowest, r.seconds);
+  }
+  auto rate = slowest > 0 ? lookups / slowest / 1e6 : 0.0;
+  fmt::println("{} Readers: {}, reader rate is {} Mkeys/s ({} Mkeys/s per "
+               "reader), {} updates in {} seconds",
+               name, readers, rate, rate / std::max(readers, 1u), num_updates,
+               writer_seconds);
+  fmt::println("{} Reader latency (ns, {} samples): p50 {}, p99 {}, p99.9 {}, "
+               "max {}, mean {}",
+               name, latency.count(), latency.percentile(50),
+               latency.percentile(99), latency.percentile(99.9), latency.max(),
+               latency.mean());
+  print_updates(name, "removeBucket", removals);
+  print_updates(name, "addBucket", additions);
+#ifdef USE_HEAPSTATS
+  const auto heap_end{heapstats::snapshot()};
+  const auto heap_growth{heap_end.live - heap_start.live};
+  const auto heap_max{heap_end.peak - heap_start.live};
+  fmt::println("{} Heap growth is {} bytes, maximum is {} bytes (at most, "
+               "summed over the threads), peak RSS is {} bytes",
+               name, heap_growth, heap_max, heapstats::peakRss());
+#endif
+
+  std::ofstream results_file;
+  results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+  results_file << name << ":\tAnchor\t" << anchor_set << "\tWorking\t"
+               << working_set << "\tUpdates\t" << num_updates
+               << "\tReaders\t" << readers << "\tRate\t" << rate
+               << "\tReadP50\t" << latency.percentile(50) << "\tReadP99\t"
+               << latency.percentile(99) << "\tReadP999\t"
+               << latency.percentile(99.9) << "\tRemoveP99\t"
+               << removals.percentile(99) << "\tAddP99\t"
+               << additions.percentile(99);
+#ifdef USE_HEAPSTATS
+  results_file << "\tHeapGrowth\t" << heap_growth << "\tMaxHeapGrowth\t"
+               << heap_max << "\tPeakRss\t" << heapstats::peakRss();
+#endif
+  results_file << "\n";
+  results_file.close();
+
+  return 0;
+}
+
+/*
+ * Runs the churn benchmark or, with readers, the concurrent one for each
+ * synchronization policy
+ */
+template <typename Algorithm>
+int run(const std::string_view name, const ChurnOptions &options) {
+  if (options.readers == 0) {
+    return churn<Algorithm>(name, options);
+  }
+  if constexpr (!requires(const Algorithm &e) { e.getBucketCRC32c(0, 0); }) {
+    fmt::println("{} has no read-only lookup and cannot be shared between "
+                 "threads",
+                 name);
+    return 2;
+  } else {
+    int rc{0};
+    for (const auto &sync : options.sync) {
+      if (sync == "mutex") {
+        rc |= churn_concurrent<LockedEngine<Algorithm, std::mutex>>(
+            fmt::format("Mutex<{}>", name), options);
+      } else if (sync == "shared") {
+        rc |= churn_concurrent<LockedEngine<Algorithm, std::shared_mutex>>(
+            fmt::format("SharedMutex<{}>", name), options);
+      } else if (sync == "seqlock") {
+        if constexpr (std::is_trivially_copyable_v<Algorithm>) {
+          rc |= churn_concurrent<SeqlockEngine<Algorithm>>(
+              fmt::format("Seqlock<{}>", name), options);
+        } else {
+          fmt::println("Seqlock<{}> is not supported (the engine is not "
+                       "trivially copyable)",
+                       name);
+        }
+      } else if (sync == "rcu") {
+        if constexpr (std::is_copy_constructible_v<Algorithm>) {
+          rc |= churn_concurrent<RcuEngine<Algorithm>>(
+              fmt::format("RCU<{}>", name), options);
+        } else {
+          fmt::println("RCU<{}> is not supported (the engine is not copy "
+                       "constructible)",
+                       name);
+        }
+      } else {
+        fmt::println("Unknown synchronization policy {}", sync);
+        rc |= 2;
+      }
+    }
+    return rc;
+  }
+}
+
+/*
+ * The algorithms of the benchmark
+ */
+using Algorithms =
+    Engines::With<CachedEngine<MementoEngine<boost::unordered_flat_map>>,
+                  CachedEngine<AnchorEngine>>;
+
+int main(int argc, char *argv[]) {
+  cxxopts::Options options("churn",
+                           "Lookups interleaved with membership changes");
+  options.add_options()(
+      "Algorithm",
+      "Algorithm (" + Algorithms::names() + ")",
+      cxxopts::value<std::string>())(
+      "AnchorSet", "Size of the AnchorSet (ignored by Memento)",
+      cxxopts::value<int>())("WorkingSet", "Initial size of the WorkingSet",
+                             cxxopts::value<int>())(
+      "NumUpdates", "Number of random removals and additions",
+      cxxopts::value<int>())("NumKeys", "Total number of keys to lookup for",
+                             cxxopts::value<int>())(
+      "ResFileName", "Output file name", cxxopts::value<std::string>())(
+      "remove-probability", "Probability that an update is a removal",
+      cxxopts::value<double>()->default_value("0.5"))(
+      "min-working",
+      "Minimum size of the WorkingSet (default is half the WorkingSet)",
+      cxxopts::value<int>()->default_value("0"))(
+      "intervals", "Number of intervals of the lookup rate report",
+      cxxopts::value<int>()->default_value("10"))(
+      "keys", "Key source (uniform|zipf:S|hotspot:F:P|sequential)",
+      cxxopts::value<std::string>()->default_value("uniform"))(
+      "keyspace", "Number of distinct keys (zipf and hotspot)",
+      cxxopts::value<int>()->default_value("1000000"))(
+      "seed", "Seed for keys and updates (0 means random)",
+      cxxopts::value<uint64_t>()->default_value("0"))(
+      "readers",
+      "Number of reader threads looking up keys while the writer updates "
+      "the engine (0 interleaves lookups and updates in one thread)",
+      cxxopts::value<int>()->default_value("0"))(
+      "sync",
+      "Comma separated synchronization policies of the readers "
+      "(mutex|shared|seqlock|rcu)",
+      cxxopts::value<std::string>()->default_value("mutex,shared,seqlock,rcu"))(
+      "update-interval-us", "Pause of the writer between two updates",
+      cxxopts::value<int>()->default_value("100"))(
+      "latency-sample", "Readers time one lookup every N lookups",
+      cxxopts::value<int>()->default_value("16"));
+  options.positional_help(
+      "Algorithm AnchorSet WorkingSet NumUpdates NumKeys ResFilename");
+  options.parse_positional({"Algorithm", "AnchorSet", "WorkingSet",
+                            "NumUpdates", "NumKeys", "ResFileName"});
+  auto result = options.parse(argc, argv);
+  if (!result.count("ResFileName")) {
+    fmt::println("{}", options.help());
+    exit(1);
+  }
+
+  auto algorithm = result["Algorithm"].as<std::string>();
+  auto working_set = static_cast<uint32_t>(result["WorkingSet"].as<int>());
+  auto min_working = static_cast<uint32_t>(result["min-working"].as<int>());
+  ChurnOptions churn_options{
+      .filename = result["ResFileName"].as<std::string>(),
+      .anchor_set = static_cast<uint32_t>(result["AnchorSet"].as<int>()),
+      .working_set = working_set,
+      .num_updates = static_cast<uint32_t>(result["NumUpdates"].as<int>()),
+      .num_keys = static_cast<uint32_t>(result["NumKeys"].as<int>()),
+      .remove_probability = result["remove-probability"].as<double>(),
+      .min_working = min_working ? min_working : working_set / 2,
+      .intervals = static_cast<uint32_t>(result["intervals"].as<int>()),
+      .key_source = result["keys"].as<std::string>(),
+      .keyspace = static_cast<uint32_t>(result["keyspace"].as<int>()),
+      .seed = result["seed"].as<uint64_t>(),
+      .readers = static_cast<uint32_t>(result["readers"].as<int>()),
+      .sync = splitList(result["sync"].as<std::string>()),
+      .update_interval_us =
+          static_cast<uint32_t>(result["update-interval-us"].as<int>()),
+      .latency_sample =
+          static_cast<uint32_t>(result["latency-sample"].as<int>())};
+
+  fmt::println("Algorithm: {}, AnchorSet: {}, WorkingSet: {}, NumUpdates: {}, "
+               "NumKeys: {}, ResFileName: {}",
+               algorithm, churn_options.anchor_set, working_set,
+               churn_options.num_updates, churn_options.num_keys,
+               churn_options.filename);
+
+  return Algorithms::dispatch(
+      algorithm, [&]<typename Algorithm>(const std::string &name) {
+        return run<Algorithm>(name, churn_options);
+      });
+}
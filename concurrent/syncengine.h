@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SYNCENGINE_H
+#define SYNCENGINE_H
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <type_traits>
+
+/*
+ * Synchronization policies that let any number of threads look up keys
+ * while other threads add and remove buckets. Each one wraps an engine
+ * with a read-only getBucketCRC32c and exposes the same interface.
+ */
+
+/**
+ * Lookups and updates under a lock: with std::mutex every operation is
+ * exclusive, with std::shared_mutex lookups take a shared lock.
+ *
+ * @tparam Engine the wrapped engine
+ * @tparam Mutex  std::mutex, std::shared_mutex or a compatible lock
+ */
+template <typename Engine, typename Mutex = std::mutex>
+class LockedEngine final {
+public:
+  LockedEngine(uint32_t anchor_set, uint32_t working_set)
+      : m_engine{anchor_set, working_set} {}
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const {
+    if constexpr (requires(Mutex &m) { m.lock_shared(); }) {
+      std::shared_lock lock{m_mutex};
+      return m_engine.getBucketCRC32c(key, seed);
+    } else {
+      std::lock_guard lock{m_mutex};
+      return m_engine.getBucketCRC32c(key, seed);
+    }
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() {
+    std::lock_guard lock{m_mutex};
+    return m_engine.addBucket();
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) {
+    std::lock_guard lock{m_mutex};
+    return m_engine.removeBucket(bucket);
+  }
+
+private:
+  mutable Mutex m_mutex;
+  Engine m_engine;
+};
+
+/**
+ * Lookups on a private copy of the engine taken under a sequence lock:
+ * readers never block the writer and retry if an update happened while
+ * they were copying.
+ * <p>
+ * A seqlock can only protect plain data, since a reader may observe a
+ * half-written state before detecting the update: the engine must be
+ * trivially copyable (e.g. JumpEngine, PowerEngine). The state is stored
+ * in atomic words, so that concurrent reads are not data races.
+ *
+ * @tparam Engine the wrapped (trivially copyable) engine
+ */
+template <typename Engine> class SeqlockEngine final {
+  static_assert(std::is_trivially_copyable_v<Engine>,
+                "A seqlock requires a trivially copyable engine");
+  static constexpr size_t WORDS = (sizeof(Engine) + 7) / 8;
+
+public:
+  SeqlockEngine(uint32_t anchor_set, uint32_t working_set)
+      : m_engine{anchor_set, working_set} {
+    publish();
+  }
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept {
+    std::array<uint64_t, WORDS> copy;
+    for (;;) {
+      const auto before = m_sequence.load(std::memory_order_acquire);
+      if (before & 1) {
+        continue;
+      }
+      for (size_t i = 0; i < WORDS; ++i) {
+        copy[i] = m_words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (m_sequence.load(std::memory_order_relaxed) == before) {
+        break;
+      }
+    }
+    /* Copying the bytes into the storage creates the engine */
+    alignas(Engine) std::byte storage[sizeof(Engine)];
+    std::memcpy(storage, copy.data(), sizeof(Engine));
+    return std::launder(reinterpret_cast<const Engine *>(storage))
+        ->getBucketCRC32c(key, seed);
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() {
+    std::lock_guard lock{m_writer};
+    auto b = m_engine.addBucket();
+    publish();
+    return b;
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) {
+    std::lock_guard lock{m_writer};
+    auto b = m_engine.removeBucket(bucket);
+    publish();
+    return b;
+  }
+
+private:
+  /* Copies the engine to the shared words (writer only) */
+  void publish() noexcept {
+    std::array<uint64_t, WORDS> words{};
+    std::memcpy(words.data(), &m_engine, sizeof(Engine));
+    const auto sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < WORDS; ++i) {
+      m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  alignas(64) std::atomic<uint64_t> m_sequence{0};
+  std::array<std::atomic<uint64_t>, WORDS> m_words{};
+  alignas(64) std::mutex m_writer;
+  Engine m_engine;
+};
+
+/**
+ * Read-copy-update: lookups run on an immutable snapshot of the engine,
+ * updates copy the current snapshot, change the copy and publish it.
+ * Snapshots are reference counted, so an old one is freed when its last
+ * reader is done.
+ * <p>
+ * Readers never wait for the writer, but each update copies the whole
+ * engine (O(anchor set) for Anchor, O(removed buckets) for Memento).
+ *
+ * @tparam Engine the wrapped (copy constructible) engine
+ */
+template <typename Engine> class RcuEngine final {
+  static_assert(std::is_copy_constructible_v<Engine>,
+                "RCU requires a copy constructible engine");
+
+public:
+  RcuEngine(uint32_t anchor_set, uint32_t working_set)
+      : m_current{std::make_shared<const Engine>(anchor_set, working_set)} {}
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept {
+    return m_current.load(std::memory_order_acquire)
+        ->getBucketCRC32c(key, seed);
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() {
+    return update([](Engine &e) { return e.addBucket(); });
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) {
+    return update([bucket](Engine &e) { return e.removeBucket(bucket); });
+  }
+
+private:
+  template <typename Update> uint32_t update(Update &&change) {
+    std::lock_guard lock{m_writer};
+    auto next =
+        std::make_shared<Engine>(*m_current.load(std::memory_order_relaxed));
+    auto b = change(*next);
+    m_current.store(std::move(next), std::memory_order_release);
+    return b;
+  }
+
+  std::atomic<std::shared_ptr<const Engine>> m_current;
+  std::mutex m_writer;
+};
+
+#endif // SYNCENGINE_H
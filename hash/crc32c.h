@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+#include <cstddef>
+#include <cstdint>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+/**
+ * Hardware CRC32c of a 64-bit key (from AnchorHash), shared by the engines.
+ * <p>
+ * With SSE4.2 enabled at compile time (-msse4.2) the intrinsic is used, so
+ * that the compiler can schedule, hoist and merge the instruction; otherwise
+ * the instruction is emitted with a (non volatile) asm statement.
+ *
+ * @param key the key
+ * @param seed the seed
+ * @return the CRC32c of the key
+ */
+inline uint32_t crc32c_sse42_u64(uint64_t key, uint64_t seed) noexcept {
+#ifdef __SSE4_2__
+  return static_cast<uint32_t>(_mm_crc32_u64(seed, key));
+#else
+  __asm__("crc32q %[key], %[seed];" : [seed] "+r"(seed) : [key] "rm"(key));
+  return seed;
+#endif
+}
+
+/**
+ * Hashes a batch of keys with four independent CRC32c streams interleaved:
+ * the crc32 instruction has a latency of 3 cycles but a throughput of one
+ * per cycle, so that the batch is hashed at the throughput. The engines
+ * still hash key by key: out-of-order execution already overlaps the hashes
+ * of consecutive lookups. The batch benchmark of speed_test measures the
+ * hashing alone with it, and the lookups from these hashes
+ * (getBucketFromHash) against the lookups that hash key by key.
+ *
+ * @param keys the keys
+ * @param seeds the seeds (one per key)
+ * @param count the number of keys
+ * @param out the resulting hashes (at least count elements)
+ */
+inline void crc32cBatch(const uint64_t *keys, const uint64_t *seeds,
+                        size_t count, uint32_t *out) noexcept {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const auto h0 = crc32c_sse42_u64(keys[i], seeds[i]);
+    const auto h1 = crc32c_sse42_u64(keys[i + 1], seeds[i + 1]);
+    const auto h2 = crc32c_sse42_u64(keys[i + 2], seeds[i + 2]);
+    const auto h3 = crc32c_sse42_u64(keys[i + 3], seeds[i + 3]);
+    out[i] = h0;
+    out[i + 1] = h1;
+    out[i + 2] = h2;
+    out[i + 3] = h3;
+  }
+  for (; i < count; ++i) {
+    out[i] = crc32c_sse42_u64(keys[i], seeds[i]);
+  }
+}
+
+#endif // CRC32C_H
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FASTRANGE_H
+#define FASTRANGE_H
+#include <cstdint>
+
+/**
+ * Option of MementoEngine and BasicAnchorEngine (e.g.
+ * MementoEngine<Map, FastRange>, BasicAnchorEngine<FastRange>): the hashes
+ * are reduced to a range with fastrange instead of a modulo. The engines
+ * then map keys differently, so they are distinct algorithms.
+ */
+struct FastRange final {};
+
+/**
+ * Maps a uniform 32-bit hash to [0,n) with Lemire's multiply-shift range
+ * reduction: one multiplication instead of a division. The result is as
+ * uniform as hash % n, but depends on the high bits of the hash.
+ *
+ * @param hash the hash
+ * @param n the size of the range (0 < n)
+ * @return the value in [0,n)
+ */
+inline uint32_t fastrange32(uint32_t hash, uint32_t n) noexcept {
+  return static_cast<uint32_t>((static_cast<uint64_t>(hash) * n) >> 32);
+}
+
+/**
+ * Maps a uniform 64-bit hash to [0,n) with Lemire's multiply-shift range
+ * reduction.
+ *
+ * @param hash the hash
+ * @param n the size of the range (0 < n)
+ * @return the value in [0,n)
+ */
+inline uint32_t fastrange64(uint64_t hash, uint32_t n) noexcept {
+  return static_cast<uint32_t>((static_cast<__uint128_t>(hash) * n) >> 64);
+}
+
+#endif // FASTRANGE_H
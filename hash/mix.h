@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MIX_H
+#define MIX_H
+#include <cstdint>
+
+/**
+ * MurmurHash3 32-bit finalizer: a non-linear bijective mixer. CRC32c is
+ * affine, so a value derived from a CRC32c hash with this mixer is
+ * (practically) independent of a range reduction of the same hash.
+ *
+ * @param h the hash
+ * @return the mixed hash
+ */
+inline uint32_t mix32(uint32_t h) noexcept {
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+#endif // MIX_H
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INTEGERJUMP_H
+#define INTEGERJUMP_H
+#include <bit>
+#include <cstdint>
+
+/**
+ * Option of BasicJumpEngine and MementoEngine (e.g.
+ * BasicJumpEngine<IntegerJump>): the jumps of JumpHash are computed with
+ * integer arithmetic only (see jumpStepInteger). The mapping is the same.
+ */
+struct IntegerJump final {};
+
+/**
+ * One jump of JumpHash as in the reference implementation:
+ * (b + 1) * (2^31 / ((key >> 33) + 1)) in double precision, truncated.
+ *
+ * @param b the current bucket
+ * @param key the current state of the generator
+ * @return the next candidate bucket
+ */
+inline int64_t jumpStepDouble(int64_t b, uint64_t key) noexcept {
+  return (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+}
+
+/**
+ * The jump of jumpStepDouble computed as IEEE 754 binary64 does it: the
+ * quotient 2^31/q and the product with b+1 are rounded to 53 bits (to
+ * nearest, ties to even), then truncated, with 128-bit integers.
+ *
+ * @param next b + 1 (at most 2^32)
+ * @param q (key >> 33) + 1 (in [1,2^31])
+ * @return the next candidate bucket
+ */
+inline int64_t jumpStepRounded(uint64_t next, uint64_t q) noexcept {
+  /* d = m * 2^e = 2^31/q rounded, with 2^52 <= m < 2^53 */
+  const int k = std::bit_width(q);
+  auto m = static_cast<uint64_t>((__uint128_t{1} << (52 + k)) / q);
+  const auto rem = static_cast<uint64_t>((__uint128_t{1} << (52 + k)) % q);
+  int e = -21 - k;
+  if (2 * rem > q) {
+    ++m;
+  }
+  if (m == uint64_t{1} << 53) {
+    m >>= 1;
+    ++e;
+  }
+
+  /* y = keep * 2^e = m * next rounded */
+  auto keep = static_cast<__uint128_t>(m) * next;
+  const auto high = static_cast<uint64_t>(keep >> 64);
+  const int width = high ? 128 - std::countl_zero(high)
+                         : std::bit_width(static_cast<uint64_t>(keep));
+  if (width > 53) {
+    const int s = width - 53;
+    const auto rest = keep & ((__uint128_t{1} << s) - 1);
+    const auto half = __uint128_t{1} << (s - 1);
+    keep >>= s;
+    e += s;
+    if (rest > half || (rest == half && (keep & 1))) {
+      ++keep;
+    }
+    if (keep == __uint128_t{1} << 53) {
+      keep >>= 1;
+      ++e;
+    }
+  }
+
+  /* Truncation (y < 2^63) */
+  if (e >= 0) {
+    return static_cast<int64_t>(keep << e);
+  }
+  return e <= -64 ? 0 : static_cast<int64_t>(keep >> -e);
+}
+
+/**
+ * The jump of jumpStepDouble with integer arithmetic only, bit-identical
+ * to the reference computation with IEEE 754 binary64 (whatever the
+ * floating point flags, such as -ffast-math or x87 precision).
+ * <p>
+ * The exact value x = (b+1) * 2^31 / q is computed with a 64-bit division.
+ * The two roundings of the reference change x by a relative error below
+ * 2^-52, that is by less than 2^-19 when x < 2^32: unless the fractional
+ * part of x is within 2^-19 of an integer, both truncate to floor(x).
+ * Otherwise (about 2^-18 of the jumps, plus the jumps beyond 2^32) the
+ * roundings are reproduced by jumpStepRounded.
+ *
+ * @param b the current bucket (b < 2^32)
+ * @param key the current state of the generator
+ * @return the next candidate bucket
+ */
+inline int64_t jumpStepInteger(int64_t b, uint64_t key) noexcept {
+  const uint64_t q = (key >> 33) + 1;
+  const uint64_t next = static_cast<uint64_t>(b) + 1;
+  const uint64_t x = next << 31;
+  const uint64_t floor = x / q;
+  const uint64_t rem = x % q;
+  if (floor < (uint64_t{1} << 32) && (rem << 19) > q &&
+      ((q - rem) << 19) > q) {
+    return static_cast<int64_t>(floor);
+  }
+  return jumpStepRounded(next, q);
+}
+
+#endif // INTEGERJUMP_H
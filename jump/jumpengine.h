@@ -15,22 +15,31 @@
  */
 #ifndef JUMPENGINE_H
 #define JUMPENGINE_H
+#include "integerjump.h"
+#include "../hash/crc32c.h"
+#include "../stats/hopstats.h"
+#include <algorithm>
 #include <cstdint>
+#include <type_traits>
+#include <utility>
+
+/**
+ * JumpHash engine.
+ * <p>
+ * Options: IntegerJump computes the jumps with integer arithmetic only
+ * (same mapping, independent of the floating point flags).
+ *
+ * @tparam Args the options
+ */
+template <typename... Args> class BasicJumpEngine final {
+    static constexpr bool INTEGER_JUMP =
+        (std::is_same_v<Args, IntegerJump> || ...);
 
-class JumpEngine final {
 public:
-    JumpEngine(uint32_t, uint32_t working_set)
+    BasicJumpEngine(uint32_t, uint32_t working_set)
         : m_num_buckets{working_set}
     {}
 
-    // From AnchorHash
-    static uint32_t crc32c_sse42_u64(uint64_t key, uint64_t seed) {
-        __asm__ volatile("crc32q %[key], %[seed];"
-                         : [seed] "+r"(seed)
-                         : [key] "rm"(key));
-        return seed;
-    }
-
     /**
    * Returns the bucket where the given key should be mapped.
    * This implementations is the same as provided by Jump authors
@@ -39,18 +48,78 @@ public:
    * @param seed the initial seed for CRC32c
    * @return the related bucket
    */
-    uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) noexcept
+    uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept
+    {
+        return jump(crc32c_sse42_u64(key, seed));
+    }
+
+    /**
+   * Returns the buckets where the given key is mapped by this engine and by
+   * another state of it (e.g. before and after a membership change). Both
+   * sizes are resolved with a single pass over the jumps.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param other the other state of the engine
+   * @return the bucket in this state and the bucket in the other state
+   */
+    std::pair<uint32_t, uint32_t>
+    getBucketPairCRC32c(uint64_t key, uint64_t seed,
+                        const BasicJumpEngine &other) const noexcept
     {
         uint64_t hash = crc32c_sse42_u64(key, seed);
+        const int64_t lo = std::min(m_num_buckets, other.m_num_buckets);
+        const int64_t hi = std::max(m_num_buckets, other.m_num_buckets);
         int64_t b = 1, j = 0;
-        while (j < m_num_buckets) {
+        while (j < lo) {
             b = j;
             hash = hash * 2862933555777941757ULL + 1;
-            j = (b + 1) * (double(1LL << 31) / double((hash >> 33) + 1));
+            j = step(b, hash);
         }
-        return b;
+        const uint32_t first = b;
+        while (j < hi) {
+            b = j;
+            hash = hash * 2862933555777941757ULL + 1;
+            j = step(b, hash);
+        }
+        if (m_num_buckets <= other.m_num_buckets) {
+            return {first, static_cast<uint32_t>(b)};
+        }
+        return {static_cast<uint32_t>(b), first};
+    }
+
+    /**
+   * Returns count distinct buckets where the given key should be
+   * replicated. The first one is the bucket returned by getBucketCRC32c.
+   * The candidates come from a single stream of hashes, each derived from
+   * the previous one with one CRC32c step, and duplicates are skipped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param count the number of replicas
+   * @param out the resulting buckets (at least count elements)
+   * @return the number of replicas, that is min(count, number of buckets)
+   */
+    uint32_t getReplicasCRC32c(uint64_t key, uint64_t seed, uint32_t count,
+                               uint32_t *out) const noexcept
+    {
+        count = count < m_num_buckets ? count : m_num_buckets;
+        uint64_t hash = crc32c_sse42_u64(key, seed);
+        for (uint32_t n = 0; n < count;) {
+            const auto b = jump(hash);
+            uint32_t i = 0;
+            while (i < n && out[i] != b) {
+                ++i;
+            }
+            if (i == n) {
+                out[n++] = b;
+            }
+            hash = crc32c_sse42_u64(hash, key);
+        }
+        return count;
     }
 
+
     /**
    * Adds a new bucket to the engine.
    *
@@ -71,7 +140,34 @@ public:
     }
 
 private:
+    // From Jump paper
+    uint32_t jump(uint64_t hash) const noexcept
+    {
+        int64_t b = 1, j = 0;
+        HOPSTATS_DECLARE(hops);
+        while (j < m_num_buckets) {
+            HOPSTATS_INCREMENT(hops);
+            b = j;
+            hash = hash * 2862933555777941757ULL + 1;
+            j = step(b, hash);
+        }
+        HOPSTATS_RECORD(Jump, hops);
+        return b;
+    }
+
+    /* One jump, in double precision or with integers only */
+    static int64_t step(int64_t b, uint64_t hash) noexcept
+    {
+        if constexpr (INTEGER_JUMP) {
+            return jumpStepInteger(b, hash);
+        } else {
+            return jumpStepDouble(b, hash);
+        }
+    }
+
     uint32_t m_num_buckets;
 };
 
+using JumpEngine = BasicJumpEngine<>;
+
 #endif // JUMPENGINE_H
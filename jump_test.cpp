@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include "jump/jumpengine.h"
+
+/* Cross-checks the integer jumps against the double precision reference */
+
+static uint64_t splitmix64(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+int main() {
+    uint64_t state{42};
+
+    /* Single jumps, half of them with (b+1)*2^31/q within 2^-19 of an integer */
+    for (uint64_t i = 0; i < 100000000; ++i) {
+        int64_t b = splitmix64(state) & 0xFFFFFFFF;
+        const uint64_t key = splitmix64(state);
+        if (i & 1) {
+            const uint64_t q = (key >> 33) + 1;
+            const uint64_t target = splitmix64(state) & 0xFFFFFFFF;
+            const auto next = static_cast<int64_t>(
+                (static_cast<__uint128_t>(target) * q) >> 31) +
+                static_cast<int64_t>(i % 3) - 1;
+            if (next < 1 || next > (1LL << 32)) {
+                continue;
+            }
+            b = next - 1;
+        }
+        assert(jumpStepInteger(b, key) == jumpStepDouble(b, key));
+    }
+
+    /* Lookups for every number of buckets up to 4096 */
+    for (uint32_t n = 1; n <= 4096; ++n) {
+        JumpEngine reference{n, n};
+        BasicJumpEngine<IntegerJump> integer{n, n};
+        for (uint32_t k = 0; k < 10000; ++k) {
+            const auto key = splitmix64(state);
+            assert(integer.getBucketCRC32c(key, k) ==
+                   reference.getBucketCRC32c(key, k));
+        }
+    }
+
+    /* Lookups for random numbers of buckets up to 2^32-1 */
+    for (uint32_t i = 0; i < 100000; ++i) {
+        const auto n = static_cast<uint32_t>(splitmix64(state) >>
+                                             (splitmix64(state) % 32));
+        JumpEngine reference{n, n};
+        BasicJumpEngine<IntegerJump> integer{n, n};
+        for (uint32_t k = 0; k < 100; ++k) {
+            const auto key = splitmix64(state);
+            assert(integer.getBucketCRC32c(key, k) ==
+                   reference.getBucketCRC32c(key, k));
+        }
+    }
+
+    std::cout << "Integer jumps match the double precision jumps" << std::endl;
+}
@@ -172,10 +172,7 @@ public:
     }
   }
 
-  const iterator &end() const {
-    static iterator e;
-    return e;
-  }
+  iterator end() const noexcept { return iterator{}; }
 };
 
 #endif // MASHTABLE_H
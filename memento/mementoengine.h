@@ -16,11 +16,55 @@
 #ifndef MEMENTOENGINE_H
 #define MEMENTOENGINE_H
 #include "memento.h"
+#include "shortcuts.h"
+#include "../hash/crc32c.h"
+#include "../hash/fastrange.h"
+#include "../hash/mix.h"
+#include "../jump/integerjump.h"
+#include "../stats/hopstats.h"
+#include <climits>
+#include <cstdint>
 #include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <xxhash.h>
 
+/**
+ * Option of MementoEngine (MementoEngine<Map, DigestRehash>): getBucket
+ * re-hashes a key that hits a removed bucket by mixing the 64-bit digest of
+ * the key with the bucket, instead of hashing the whole key again.
+ */
+struct DigestRehash final {};
+
+/**
+ * MementoHash engine.
+ * <p>
+ * Options: PathCompression keeps a shortcut index of the replacement chains
+ * (see MementoShortcuts), so that following a chain costs at most one more
+ * lookup, at the price of about twice the memory of the removal set and of
+ * slower removals and additions. The mapping is unchanged.
+ * DigestRehash makes the re-hashes of getBucket independent of the length
+ * of the key, but changes the mapping of the keys that hit a removed bucket.
+ * FastRange reduces the re-hashes with fastrange instead of a modulo (a
+ * different mapping as well).
+ * IntegerJump computes the jumps of the JumpHash stage with integer
+ * arithmetic only (same mapping).
+ *
+ * @tparam MementoMap the map type of the removal set
+ * @tparam Args the options
+ */
 template <template <typename...> class MementoMap, typename... Args>
 class MementoEngine final {
+  static constexpr bool PATH_COMPRESSION =
+      (std::is_same_v<Args, PathCompression> || ...);
+  static constexpr bool DIGEST_REHASH =
+      (std::is_same_v<Args, DigestRehash> || ...);
+  static constexpr bool FAST_RANGE =
+      (std::is_same_v<Args, FastRange> || ...);
+  static constexpr bool INTEGER_JUMP =
+      (std::is_same_v<Args, IntegerJump> || ...);
+
 public:
   /**
    * Creates a new MementoHash engine.
@@ -50,7 +94,10 @@ public:
      * otherwise it is -1.
      */
     auto replacer = m_memento.replacer(b);
+    HOPSTATS_DECLARE(outer);
+    HOPSTATS_DECLARE(inner);
     while (replacer >= 0) {
+      HOPSTATS_INCREMENT(outer);
 
       /*
        * If the bucket was removed, we must re-hash and find
@@ -59,8 +106,8 @@ public:
        * represents the size of the working set when the bucket
        * was removed and get a new bucket in [0,replacer-1].
        */
-      const auto h = XXH64(key.data(), key.size(), b);
-      b = h % replacer;
+      const auto h = rehash(key, hash, b);
+      b = reduce(h, replacer);
 
       /*
        * If we hit a removed bucket we follow the replacements
@@ -68,7 +115,13 @@ public:
        * [0,replacer-1]
        */
       auto r = m_memento.replacer(b);
+      if constexpr (PATH_COMPRESSION) {
+        if (shortcut(b, r, replacer)) {
+          HOPSTATS_INCREMENT(inner);
+        }
+      }
       while (r >= replacer) {
+        HOPSTATS_INCREMENT(inner);
         b = r;
         r = m_memento.replacer(b);
       }
@@ -76,6 +129,8 @@ public:
       /* Finally we update the entry of the external loop. */
       replacer = r;
     }
+    HOPSTATS_RECORD(MementoOuter, outer);
+    HOPSTATS_RECORD(MementoInner, inner);
 
     return b;
   }
@@ -89,47 +144,158 @@ public:
    * @return the related bucket
    */
   uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept {
-    const auto hash = crc32c_sse42_u64(key, seed);
-    /*
-     * We invoke JumpHash to get a bucket
-     * in the range [0,bArraySize-1].
-     */
-    auto b = JumpConsistentHash(hash, m_bArraySize);
+    return resolveCRC32c(crc32c_sse42_u64(key, seed), key);
+  }
 
-    /*
-     * We check if the bucket was removed, if not we are done.
-     * If the bucket was removed the replacing bucket is >= 0,
-     * otherwise it is -1.
-     */
-    auto replacer = m_memento.replacer(b);
+  /**
+   * Returns the bucket where the given key should be mapped, given the
+   * CRC32c hash of the key computed beforehand (e.g. by crc32cBatch): same
+   * result as getBucketCRC32c(key, seed) when hash is
+   * crc32c_sse42_u64(key, seed).
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param hash the CRC32c hash of the key with the seed
+   * @return the related bucket
+   */
+  uint32_t getBucketFromHash(uint64_t key, uint64_t,
+                             uint32_t hash) const noexcept {
+    return resolveCRC32c(hash, key);
+  }
+
+  /**
+   * Returns the bucket where the given key should be mapped when every
+   * candidate c of the lookup (the bucket of the JumpHash stage, then one
+   * for each removed bucket met, after following the replacements) is kept
+   * only if a hash of the key is below thresholds[c], and drawn again
+   * otherwise (see WeightedEngine). The candidates do not depend on the
+   * state of the buckets, so the lookup is as monotone as getBucketCRC32c.
+   * <p>
+   * The JumpHash stage draws from the whole id space (thresholds.size(),
+   * which never shrinks): the buckets past bArraySize were removed from the
+   * end of the b-array, that is with themselves as replacer.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param thresholds per bucket id (at least bArraySize of them), 2^31
+   *                   times the probability of keeping it (not 0)
+   * @return the related bucket
+   */
+  uint32_t
+  getBucketWeightedCRC32c(uint64_t key, uint64_t seed,
+                          const std::vector<uint32_t> &thresholds) const noexcept {
+    const auto span = static_cast<uint32_t>(thresholds.size());
+    /* The redraws are numbered, so that the hashes cannot cycle */
+    uint64_t n = 0;
+    uint32_t h = crc32c_sse42_u64(key, seed);
+    uint32_t b = JumpConsistentHash(h, span);
+    while ((mix32(h) >> 1) >= thresholds[b]) {
+      h = crc32c_sse42_u64(key + ++n, h);
+      b = JumpConsistentHash(h, span);
+    }
+
+    auto replacer = replacerOf(b);
     while (replacer >= 0) {
+      /* Draw in [0,replacer-1] and follow the replacements, as in
+       * resolveCRC32c, until the candidate is kept */
+      h = crc32c_sse42_u64(key, b);
+      for (;;) {
+        auto c = reduce(h, replacer);
+        auto r = replacerOf(c);
+        if constexpr (PATH_COMPRESSION) {
+          shortcut(c, r, replacer);
+        }
+        while (r >= replacer) {
+          c = r;
+          r = replacerOf(c);
+        }
+        if ((mix32(h) >> 1) < thresholds[c]) {
+          b = c;
+          replacer = r;
+          break;
+        }
+        h = crc32c_sse42_u64(key + ++n, h);
+      }
+    }
 
-      /*
-       * If the bucket was removed, we must re-hash and find
-       * a new bucket in the remaining slots. To know the
-       * remaining slots, we look at 'replacer' that also
-       * represents the size of the working set when the bucket
-       * was removed and get a new bucket in [0,replacer-1].
-       */
-      const auto h = crc32c_sse42_u64(key, b);
-      b = h % replacer;
+    return b;
+  }
 
-      /*
-       * If we hit a removed bucket we follow the replacements
-       * until we get a working bucket or a bucket in the range
-       * [0,replacer-1]
-       */
+  /**
+   * Returns the buckets where the given key is mapped by this engine and by
+   * another state of it (e.g. before and after a membership change): the
+   * hash and the JumpHash stage are shared, and the replacement chains are
+   * followed together as long as both states have the same replacers, then
+   * each state completes its own chain. Both removal sets are probed at
+   * every step, so only the hashing is saved.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param other the other state of the engine
+   * @return the bucket in this state and the bucket in the other state
+   */
+  std::pair<uint32_t, uint32_t>
+  getBucketPairCRC32c(uint64_t key, uint64_t seed,
+                      const MementoEngine &other) const noexcept {
+    const auto hash = crc32c_sse42_u64(key, seed);
+    uint32_t b, o;
+    JumpConsistentHashPair(hash, m_bArraySize, other.m_bArraySize, b, o);
+    int32_t replacer = INT32_MAX;
+    while (b == o) {
+      /* Follow the replacements while both states agree */
       auto r = m_memento.replacer(b);
-      while (r >= replacer) {
-        b = r;
+      auto ro = other.m_memento.replacer(b);
+      while (r == ro && r >= replacer) {
+        b = o = r;
         r = m_memento.replacer(b);
+        ro = other.m_memento.replacer(b);
+      }
+      if (r != ro) {
+        break;
       }
-
-      /* Finally we update the entry of the external loop. */
       replacer = r;
+      if (replacer < 0) {
+        return {b, b};
+      }
+      b = o = reduce(crc32c_sse42_u64(key, b), replacer);
     }
+    return {resolveFrom(b, replacer, key), other.resolveFrom(o, replacer, key)};
+  }
 
-    return b;
+  /**
+   * Returns count distinct working buckets where the given key should be
+   * replicated. The first one is the bucket returned by getBucketCRC32c.
+   * <p>
+   * The candidates come from a single stream of hashes, each derived from
+   * the previous one with one CRC32c step, and duplicates are skipped.
+   * Removing a bucket only changes the candidates that were mapped to it,
+   * so only the replica on that bucket changes (unless the removed bucket
+   * also appeared as a skipped duplicate, with probability O(count^2/size)).
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param count the number of replicas
+   * @param out the resulting buckets (at least count elements)
+   * @return the number of replicas, that is min(count, size())
+   */
+  uint32_t getReplicasCRC32c(uint64_t key, uint64_t seed, uint32_t count,
+                             uint32_t *out) const noexcept {
+    count = count < size() ? count : size();
+    uint64_t hash = crc32c_sse42_u64(key, seed);
+    uint64_t rkey = key;
+    for (uint32_t n = 0; n < count;) {
+      const auto b = resolveCRC32c(hash, rkey);
+      uint32_t i = 0;
+      while (i < n && out[i] != b) {
+        ++i;
+      }
+      if (i == n) {
+        out[n++] = b;
+      }
+      hash = crc32c_sse42_u64(hash, key);
+      rkey = hash;
+    }
+    return count;
   }
 
   /**
@@ -140,6 +306,9 @@ public:
   uint32_t addBucket() noexcept {
     /* The new bucket to add is the last removed one. */
     auto bucket = m_lastRemoved;
+    if constexpr (PATH_COMPRESSION) {
+      m_shortcuts.restore(bucket);
+    }
 
     /**
      * We restore the bucket from the replacement set
@@ -175,7 +344,11 @@ public:
 
     /* Otherwise, we add the entry to the memento table using the removed bucket
      * as the key. */
-    m_lastRemoved = m_memento.remember(bucket, size() - 1, m_lastRemoved);
+    const auto replacer = size() - 1;
+    m_lastRemoved = m_memento.remember(bucket, replacer, m_lastRemoved);
+    if constexpr (PATH_COMPRESSION) {
+      m_shortcuts.remove(bucket, replacer);
+    }
 
     return bucket;
   }
@@ -195,12 +368,177 @@ public:
   uint32_t bArraySize() const noexcept { return m_bArraySize; }
 
 private:
-  // From AnchorHash
-  static uint32_t crc32c_sse42_u64(uint64_t key, uint64_t seed) {
-    __asm__ volatile("crc32q %[key], %[seed];"
-                     : [seed] "+r"(seed)
-                     : [key] "rm"(key));
-    return seed;
+  /**
+   * Returns the bucket where a key with the given CRC32c hash
+   * should be mapped.
+   *
+   * @param hash the hash of the key
+   * @param key the key used to re-hash when hitting a removed bucket
+   * @return the related bucket
+   */
+  uint32_t resolveCRC32c(uint64_t hash, uint64_t key) const noexcept {
+    /*
+     * We invoke JumpHash to get a bucket
+     * in the range [0,bArraySize-1].
+     */
+    auto b = JumpConsistentHash(hash, m_bArraySize);
+
+    /*
+     * We check if the bucket was removed, if not we are done.
+     * If the bucket was removed the replacing bucket is >= 0,
+     * otherwise it is -1.
+     */
+    auto replacer = m_memento.replacer(b);
+    HOPSTATS_DECLARE(outer);
+    HOPSTATS_DECLARE(inner);
+    while (replacer >= 0) {
+      HOPSTATS_INCREMENT(outer);
+
+      /*
+       * If the bucket was removed, we must re-hash and find
+       * a new bucket in the remaining slots. To know the
+       * remaining slots, we look at 'replacer' that also
+       * represents the size of the working set when the bucket
+       * was removed and get a new bucket in [0,replacer-1].
+       */
+      const auto h = crc32c_sse42_u64(key, b);
+      b = reduce(h, replacer);
+
+      /*
+       * If we hit a removed bucket we follow the replacements
+       * until we get a working bucket or a bucket in the range
+       * [0,replacer-1]
+       */
+      auto r = m_memento.replacer(b);
+      if constexpr (PATH_COMPRESSION) {
+        if (shortcut(b, r, replacer)) {
+          HOPSTATS_INCREMENT(inner);
+        }
+      }
+      while (r >= replacer) {
+        HOPSTATS_INCREMENT(inner);
+        b = r;
+        r = m_memento.replacer(b);
+      }
+
+      /* Finally we update the entry of the external loop. */
+      replacer = r;
+    }
+    HOPSTATS_RECORD(MementoOuter, outer);
+    HOPSTATS_RECORD(MementoInner, inner);
+
+    return b;
+  }
+
+  /**
+   * Returns the replacer of a bucket, taking the buckets past bArraySize as
+   * replaced by themselves.
+   *
+   * @param b the bucket
+   * @return the replacer of the bucket (-1 if working)
+   */
+  int32_t replacerOf(uint32_t b) const noexcept {
+    return b < m_bArraySize ? m_memento.replacer(b) : static_cast<int32_t>(b);
+  }
+
+  /**
+   * Completes a lookup from a candidate bucket, as in the inner loop of
+   * resolveCRC32c.
+   *
+   * @param b the candidate bucket
+   * @param replacer the size of the working set the candidate was drawn
+   *                 from (INT32_MAX for the JumpHash stage)
+   * @param key the key used to re-hash when hitting a removed bucket
+   * @return the related bucket
+   */
+  uint32_t resolveFrom(uint32_t b, int32_t replacer,
+                       uint64_t key) const noexcept {
+    for (;;) {
+      auto r = m_memento.replacer(b);
+      if constexpr (PATH_COMPRESSION) {
+        shortcut(b, r, replacer);
+      }
+      while (r >= replacer) {
+        b = r;
+        r = m_memento.replacer(b);
+      }
+      replacer = r;
+      if (replacer < 0) {
+        return b;
+      }
+      b = reduce(crc32c_sse42_u64(key, b), replacer);
+    }
+  }
+
+  /**
+   * Jumps from a candidate bucket to the tail of its chain with the
+   * shortcut index, when the lookup would follow the chain up to its tail.
+   *
+   * @param b the candidate bucket, replaced by the tail
+   * @param r the replacer of the candidate, replaced by -1
+   * @param replacer the size of the working set the candidate was drawn from
+   * @return true if the shortcut was taken
+   */
+  template <typename Bucket>
+  bool shortcut(Bucket &b, int32_t &r, int32_t replacer) const noexcept {
+    if (r >= replacer) {
+      const auto tail = m_shortcuts.tail(b, replacer);
+      if (tail >= 0) {
+        b = tail;
+        r = -1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Draws a bucket in [0,replacer) from a hash.
+   *
+   * @param hash the hash (32 or 64 bits)
+   * @param replacer the size of the working set
+   * @return the bucket
+   */
+  template <typename Hash>
+  static uint32_t reduce(Hash hash, int32_t replacer) noexcept {
+    if constexpr (!FAST_RANGE) {
+      return hash % replacer;
+    } else if constexpr (sizeof(Hash) > sizeof(uint32_t)) {
+      return fastrange64(hash, replacer);
+    } else {
+      return fastrange32(hash, replacer);
+    }
+  }
+
+  /**
+   * Returns the hash of a key used to draw a bucket after hitting the given
+   * removed bucket.
+   *
+   * @param key the key
+   * @param hash the XXH64 digest of the key
+   * @param b the removed bucket
+   * @return the new hash
+   */
+  static uint64_t rehash(std::string_view key, uint64_t hash,
+                         uint64_t b) noexcept {
+    if constexpr (DIGEST_REHASH) {
+      /* SplitMix64 finalizer of the digest and the bucket */
+      auto h = hash + (b + 1) * 0x9E3779B97F4A7C15ULL;
+      h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+      return h ^ (h >> 31);
+    } else {
+      return XXH64(key.data(), key.size(), b);
+    }
+  }
+
+  /* One jump of JumpHash, in double precision or with integers only */
+  static int64_t step(int64_t b, uint64_t key) noexcept {
+    if constexpr (INTEGER_JUMP) {
+      return jumpStepInteger(b, key);
+    } else {
+      return jumpStepDouble(b, key);
+    }
   }
 
   // From Jump paper
@@ -209,12 +547,38 @@ private:
     while (j < num_buckets) {
       b = j;
       key = key * 2862933555777941757ULL + 1;
-      j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+      j = step(b, key);
     }
     return b;
   }
 
+  // JumpHash for two sizes with a single pass over the jumps
+  static void JumpConsistentHashPair(uint64_t key, int32_t n1, int32_t n2,
+                                     uint32_t &b1, uint32_t &b2) {
+    int64_t b = 1, j = 0;
+    const auto lo = n1 < n2 ? n1 : n2;
+    const auto hi = n1 < n2 ? n2 : n1;
+    while (j < lo) {
+      b = j;
+      key = key * 2862933555777941757ULL + 1;
+      j = step(b, key);
+    }
+    const auto first = b;
+    while (j < hi) {
+      b = j;
+      key = key * 2862933555777941757ULL + 1;
+      j = step(b, key);
+    }
+    b1 = n1 < n2 ? first : b;
+    b2 = n1 < n2 ? b : first;
+  }
+
+  struct NoShortcuts final {};
+
   Memento<MementoMap> m_memento;
+  [[no_unique_address]] std::conditional_t<
+      PATH_COMPRESSION, MementoShortcuts<MementoMap>, NoShortcuts>
+      m_shortcuts;
   uint32_t m_bArraySize;
   uint32_t m_lastRemoved;
 };
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SHORTCUTS_H
+#define SHORTCUTS_H
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Option of MementoEngine (MementoEngine<Map, PathCompression>) that keeps
+ * a MementoShortcuts index of the replacement chains.
+ */
+struct PathCompression final {};
+
+/**
+ * Shortcut index of the replacement chains of a Memento table.
+ * <p>
+ * The replacements of the removed buckets form chains b -> r(b) -> ...
+ * that end at a working bucket (the tail), or that come back to a removed
+ * bucket after some additions and removals. A lookup that hits a removed
+ * bucket b with r(b) >= threshold follows the chain while the replacers are
+ * >= threshold. For each removed bucket the index stores the tail of its
+ * chain and the smallest replacer along it (the floor): when the floor is
+ * >= threshold the whole chain would be followed, so the tail is returned
+ * with a single lookup.
+ * <p>
+ * The index is updated incrementally: removing a working bucket x extends
+ * the chains ending at x, so the buckets whose tail is x (kept in a linked
+ * list per tail) get the tail and floor of the chain of x; their previous
+ * floors are pushed on an undo log, since buckets are restored in reverse
+ * order of removal. Restoring a bucket only touches the chains it extended.
+ * <p>
+ * Memory overhead: one 16 bytes record per removed bucket and one 4 bytes
+ * list head per tail, plus the map overhead (about twice the memory of the
+ * Memento table), and 4 bytes per chain extension in the undo log (the
+ * total length of the chains, a few entries per removed bucket).
+ *
+ * @tparam MementoMap the map type of the Memento table
+ */
+template <template <typename...> class MementoMap> class MementoShortcuts final {
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  struct Shortcut final {
+    /* The working bucket at the end of the chain */
+    uint32_t tail;
+    /* The smallest replacer along the chain */
+    int32_t floor;
+    /* The next bucket with the same tail */
+    uint32_t next;
+    /* The number of chains extended by the removal of this bucket */
+    uint32_t extended;
+  };
+
+public:
+  /**
+   * Returns the tail of the chain of the given removed bucket if a lookup
+   * would follow it up to the end.
+   *
+   * @param bucket the removed bucket (with replacer >= threshold)
+   * @param threshold the size of the working set the bucket was drawn from
+   * @return the tail of the chain, {@code -1} if the lookup stops before
+   */
+  int32_t tail(uint32_t bucket, int32_t threshold) const noexcept {
+    auto e = m_shortcuts.find(bucket);
+    if (e != m_shortcuts.end() && e->second.floor >= threshold) {
+      return e->second.tail;
+    }
+    return -1;
+  }
+
+  /**
+   * Records the removal of a working bucket, to be called after it has been
+   * remembered by the Memento table.
+   *
+   * @param bucket the removed bucket
+   * @param replacer the replacer of the bucket
+   */
+  void remove(uint32_t bucket, uint32_t replacer) {
+    /* The chain of the bucket continues with the chain of its replacer */
+    Shortcut s{replacer, static_cast<int32_t>(replacer), NONE, 0};
+    auto r = m_shortcuts.find(replacer);
+    if (r != m_shortcuts.end()) {
+      s.tail = r->second.tail;
+      s.floor = std::min(s.floor, r->second.floor);
+    }
+    if (s.tail == bucket) {
+      /*
+       * The chain comes back to the bucket: lookups always stop before
+       * completing it, so it gets no shortcut (the bucket is its own tail).
+       */
+      s.floor = -1;
+    }
+
+    /* The chains ending at the bucket now end at the new tail */
+    auto h = m_heads.find(bucket);
+    if (h != m_heads.end()) {
+      s.next = h->second;
+      m_heads.erase(h);
+      auto last = s.next;
+      for (auto m = s.next; m != NONE;) {
+        auto e = m_shortcuts.find(m);
+        auto t = e->second;
+        m_shortcuts.erase(e);
+        m_undo.push_back(t.floor);
+        t.tail = s.tail;
+        t.floor = std::min(t.floor, s.floor);
+        last = m;
+        m = t.next;
+        if (m == NONE) {
+          t.next = head(s.tail);
+        }
+        m_shortcuts.emplace(last, std::move(t));
+        ++s.extended;
+      }
+      setHead(s.tail, bucket);
+    } else {
+      s.next = head(s.tail);
+      setHead(s.tail, bucket);
+    }
+    m_shortcuts.emplace(bucket, std::move(s));
+  }
+
+  /**
+   * Records the restore of the last removed bucket, to be called before it
+   * is restored by the Memento table.
+   *
+   * @param bucket the restored bucket
+   */
+  void restore(uint32_t bucket) {
+    auto e = m_shortcuts.find(bucket);
+    if (e == m_shortcuts.end()) {
+      return;
+    }
+    const auto s = e->second;
+    m_shortcuts.erase(e);
+
+    /* The bucket and the chains it extended are first in the tail list */
+    auto m = s.next;
+    auto base = m_undo.size() - s.extended;
+    for (uint32_t i = 0; i < s.extended; ++i) {
+      auto f = m_shortcuts.find(m);
+      auto t = f->second;
+      m_shortcuts.erase(f);
+      t.tail = bucket;
+      t.floor = m_undo[base + i];
+      const auto next = t.next;
+      if (i + 1 == s.extended) {
+        t.next = NONE;
+      }
+      m_shortcuts.emplace(m, std::move(t));
+      m = next;
+    }
+    m_undo.resize(base);
+    if (m == NONE) {
+      m_heads.erase(m_heads.find(s.tail));
+    } else {
+      setHead(s.tail, m);
+    }
+    if (s.extended) {
+      setHead(bucket, s.next);
+    }
+  }
+
+private:
+  uint32_t head(uint32_t tail) const noexcept {
+    auto h = m_heads.find(tail);
+    return h != m_heads.end() ? h->second : NONE;
+  }
+
+  void setHead(uint32_t tail, uint32_t bucket) {
+    auto h = m_heads.find(tail);
+    if (h != m_heads.end()) {
+      m_heads.erase(h);
+    }
+    m_heads.emplace(tail, std::move(bucket));
+  }
+
+  MementoMap<uint32_t, Shortcut> m_shortcuts;
+  MementoMap<uint32_t, uint32_t> m_heads;
+  std::vector<int32_t> m_undo;
+};
+
+#endif // SHORTCUTS_H
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DUALEPOCH_H
+#define DUALEPOCH_H
+#include <cstdint>
+#include <utility>
+
+/**
+ * A view over two membership epochs of an engine (the old one and the new
+ * one during a migration window) that answers both owners of a key.
+ * <p>
+ * Engines with a getBucketPairCRC32c(key, seed, other) compute both owners
+ * together: JumpEngine resolves both sizes with one pass over the jumps,
+ * AnchorEngine draws the candidates once until the paths of the two epochs
+ * diverge, and MementoEngine shares the hash and the JumpHash stage but
+ * probes the removal sets of both epochs at every replacement (it saves the
+ * re-hashes, not the probes). Other engines do two lookups.
+ *
+ * @tparam Engine the engine (with a read-only lookup)
+ */
+template <typename Engine> class DualEpochView final {
+public:
+  /**
+   * Creates a new view.
+   *
+   * @param old_epoch the engine of the old epoch
+   * @param new_epoch the engine of the new epoch
+   */
+  DualEpochView(const Engine &old_epoch, const Engine &new_epoch) noexcept
+      : m_old{old_epoch}, m_new{new_epoch} {}
+
+  /**
+   * Returns the buckets where the given key is mapped in both epochs.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the bucket in the old epoch and the bucket in the new epoch
+   */
+  std::pair<uint32_t, uint32_t> getBucketPair(uint64_t key,
+                                              uint64_t seed) const noexcept {
+    if constexpr (requires { m_old.getBucketPairCRC32c(key, seed, m_new); }) {
+      return m_old.getBucketPairCRC32c(key, seed, m_new);
+    } else {
+      return {m_old.getBucketCRC32c(key, seed),
+              m_new.getBucketCRC32c(key, seed)};
+    }
+  }
+
+  /**
+   * Returns the engine of the old epoch.
+   *
+   * @return the old engine
+   */
+  const Engine &oldEpoch() const noexcept { return m_old; }
+
+  /**
+   * Returns the engine of the new epoch.
+   *
+   * @return the new engine
+   */
+  const Engine &newEpoch() const noexcept { return m_new; }
+
+private:
+  const Engine &m_old;
+  const Engine &m_new;
+};
+
+#endif // DUALEPOCH_H
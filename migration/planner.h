@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PLANNER_H
+#define PLANNER_H
+#include "dualepoch.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+/**
+ * A key that changes bucket between two states of an engine.
+ */
+struct Move final {
+  uint64_t key;
+  uint64_t seed;
+  uint32_t from;
+  uint32_t to;
+};
+
+/**
+ * Enumerates the keys that move between two states of an engine (before
+ * and after a membership change), to plan a data migration.
+ * <p>
+ * Keys are read by index from a key stream (anything with keys[i] giving
+ * a value with key and seed members, e.g. a vector or CounterKeys) and
+ * scanned in chunks by several threads; the moves of each chunk are passed
+ * to a sink as soon as the chunk is done.
+ * <p>
+ * When the change is known, a single lookup per key is enough for most
+ * keys, since consistent hashing is monotone:
+ *  - if buckets were only removed, a key moves only if it was on one of
+ *    them, so the engine after is only asked for those keys;
+ *  - if buckets were only added, a key moves only to one of them, so the
+ *    engine before is only asked for those keys.
+ * This is the case of a snapshot plus a delta of removals or additions:
+ * the second lookup is needed for about 1/n of the keys per changed
+ * bucket. Otherwise (unknown or mixed changes) both buckets are computed
+ * with a DualEpochView.
+ * Both engines must have a read-only getBucketCRC32c.
+ *
+ * @tparam Engine the engine
+ */
+template <typename Engine> class MigrationPlanner final {
+public:
+  /**
+   * Creates a new planner.
+   *
+   * @param before the engine before the change
+   * @param after the engine after the change
+   * @param threads the number of threads scanning the keys (0 means one
+   *                per core)
+   */
+  MigrationPlanner(const Engine &before, const Engine &after,
+                   uint32_t threads = 1)
+      : m_before{before}, m_after{after},
+        m_threads{threads ? threads
+                          : std::max(std::thread::hardware_concurrency(), 1u)} {
+  }
+
+  /**
+   * Declares that the change removed the given bucket.
+   *
+   * @param bucket the removed bucket (as returned by removeBucket)
+   * @return this planner
+   */
+  MigrationPlanner &removed(uint32_t bucket) {
+    mark(bucket, Removed);
+    return *this;
+  }
+
+  /**
+   * Declares that the change added the given bucket.
+   *
+   * @param bucket the added bucket (as returned by addBucket)
+   * @return this planner
+   */
+  MigrationPlanner &added(uint32_t bucket) {
+    mark(bucket, Added);
+    return *this;
+  }
+
+  /**
+   * Sets the number of keys scanned by a thread at once (and the largest
+   * number of moves passed to the sink in one call).
+   *
+   * @param keys the number of keys in a chunk (0 < keys)
+   * @return this planner
+   */
+  MigrationPlanner &chunk(uint64_t keys) noexcept {
+    m_chunk = std::max<uint64_t>(keys, 1);
+    return *this;
+  }
+
+  /**
+   * Summary of a plan.
+   */
+  struct Summary final {
+    /* Number of scanned keys */
+    uint64_t keys;
+    /* Number of moved keys */
+    uint64_t moved;
+    /* Number of engine lookups */
+    uint64_t lookups;
+  };
+
+  /**
+   * Scans the keys with index in [0,count) and passes their moves to the
+   * sink, one chunk at a time (sink(std::span<const Move>)). The sink is
+   * called by the scanning threads, but never concurrently.
+   *
+   * @param keys the key stream
+   * @param count the number of keys
+   * @param sink the receiver of the moves
+   * @return the summary of the plan
+   */
+  template <typename Keys, typename Sink>
+  Summary plan(const Keys &keys, uint64_t count, Sink &&sink) const {
+    std::atomic<uint64_t> next{0};
+    std::atomic<uint64_t> moved{0};
+    std::atomic<uint64_t> lookups{0};
+    std::mutex serialize;
+    auto scan = [&] {
+      std::vector<Move> moves;
+      moves.reserve(m_chunk);
+      uint64_t n{0}, l{0};
+      for (;;) {
+        const auto first = next.fetch_add(m_chunk, std::memory_order_relaxed);
+        if (first >= count) {
+          break;
+        }
+        const auto last = std::min(first + m_chunk, count);
+        moves.clear();
+        for (auto i = first; i < last; ++i) {
+          const auto &k = keys[i];
+          uint32_t from, to;
+          l += lookup(k.key, k.seed, from, to);
+          if (from != to) {
+            moves.push_back(Move{k.key, k.seed, from, to});
+          }
+        }
+        if (!moves.empty()) {
+          n += moves.size();
+          std::lock_guard lock{serialize};
+          sink(std::span<const Move>{moves});
+        }
+      }
+      moved.fetch_add(n, std::memory_order_relaxed);
+      lookups.fetch_add(l, std::memory_order_relaxed);
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t t = 1; t < m_threads; ++t) {
+      workers.emplace_back(scan);
+    }
+    scan();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    return Summary{count, moved.load(), lookups.load()};
+  }
+
+private:
+  enum Change : uint8_t { Unchanged, Removed, Added };
+
+  void mark(uint32_t bucket, Change change) {
+    if (bucket >= m_changed.size()) {
+      m_changed.resize(bucket + 1, Unchanged);
+    }
+    m_changed[bucket] = change;
+    (change == Removed ? m_removals : m_additions) = true;
+  }
+
+  bool is(uint32_t bucket, Change change) const noexcept {
+    return bucket < m_changed.size() && m_changed[bucket] == change;
+  }
+
+  /* Computes the buckets before and after, returns the number of lookups */
+  uint32_t lookup(uint64_t key, uint64_t seed, uint32_t &from,
+                  uint32_t &to) const noexcept {
+    if (m_removals && !m_additions) {
+      from = m_before.getBucketCRC32c(key, seed);
+      if (!is(from, Removed)) {
+        to = from;
+        return 1;
+      }
+      to = m_after.getBucketCRC32c(key, seed);
+      return 2;
+    }
+    if (m_additions && !m_removals) {
+      to = m_after.getBucketCRC32c(key, seed);
+      if (!is(to, Added)) {
+        from = to;
+        return 1;
+      }
+      from = m_before.getBucketCRC32c(key, seed);
+      return 2;
+    }
+    std::tie(from, to) =
+        DualEpochView{m_before, m_after}.getBucketPair(key, seed);
+    return 2;
+  }
+
+  const Engine &m_before;
+  const Engine &m_after;
+  uint32_t m_threads;
+  uint64_t m_chunk{1 << 16};
+  std::vector<Change> m_changed;
+  bool m_removals{false};
+  bool m_additions{false};
+};
+
+#endif // PLANNER_H
@@ -14,6 +14,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <boost/unordered/unordered_flat_map.hpp>
 #include <boost/unordered_map.hpp>
 #include <cxxopts.hpp>
@@ -22,14 +23,51 @@
 #include <random>
 #endif
 #include "anchor/anchorengine.h"
+#include "bench/affinity.h"
+#include "bench/keysource.h"
+#include "bench/lists.h"
+#include "bench/perfcounters.h"
+#include "bench/registry.h"
+#include "bench/timing.h"
 #include "jump/jumpengine.h"
 #include "memento/mashtable.h"
 #include "memento/mementoengine.h"
+#include "migration/planner.h"
 #include "power/powerengine.h"
+#include "weighted/weightedengine.h"
+#include <atomic>
 #include <fmt/core.h>
 #include <fstream>
 #include <gtl/phmap.hpp>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+/*
+ * Creates an engine: weighted engines get the weight pattern repeated
+ * over the buckets
+ */
+template <typename Algorithm>
+Algorithm make_engine(uint32_t anchor_set, uint32_t working_set,
+                      const std::vector<uint32_t> &weights) {
+  if constexpr (requires(Algorithm &e) { e.setWeight(0u, 1u); }) {
+    Algorithm engine(anchor_set, working_set,
+                     weights.empty()
+                         ? 1
+                         : *std::max_element(weights.begin(), weights.end()));
+    for (uint32_t i = 0; i < anchor_set && !weights.empty(); i++) {
+      engine.setWeight(i, weights[i % weights.size()]);
+    }
+    return engine;
+  } else {
+    return Algorithm(anchor_set, working_set);
+  }
+}
 
 /*
  * Benchmark routine
@@ -37,9 +75,33 @@
 template <typename Algorithm>
 int bench(const std::string_view name, const std::string &filename,
           uint32_t anchor_set, uint32_t working_set, uint32_t num_removals,
-          uint32_t num_keys) {
+          uint32_t num_keys, const std::string &key_source,
+          uint32_t keyspace, uint64_t seed, bool perf,
+          const std::vector<uint32_t> &weights) {
 
-  Algorithm engine(anchor_set, working_set);
+  auto engine = make_engine<Algorithm>(anchor_set, working_set, weights);
+
+  std::optional<PerfCounters> counters;
+  if (perf) {
+    counters.emplace();
+  }
+
+  std::optional<KeySource> source;
+  if (key_source != "rand") {
+    source.emplace(key_source, keyspace, seed);
+    fmt::println("Keys: {}, KeySpace: {}, Seed: {}", key_source, keyspace,
+                 source->seed());
+    if (source->distinctKeys() < num_keys) {
+      fmt::println("The key source cannot produce {} unique keys", num_keys);
+      return 2;
+    }
+  }
+  /*
+   * Monotonicity does not depend on the popularity of the keys: the
+   * distinct keys of a finite source are enumerated by id instead of drawn
+   * (which would need a very long time to find all the rare ones)
+   */
+  const bool finite{source && source->distinctKeys() != UINT64_MAX};
 
   // random removals
   uint32_t *bucket_status = new uint32_t[anchor_set]();
@@ -70,13 +132,20 @@ int bench(const std::string_view name, const std::string &filename,
 
   // Determine the current key bucket assigment
   for (uint32_t i = 0; i < num_keys;) {
+    uint32_t a, b;
+    if (source) {
+      auto k = finite ? source->key(i) : source->next();
+      a = k.key;
+      b = k.seed;
+    } else {
 #ifdef USE_PCG32
-    auto a{rng()};
-    auto b{rng()};
+      a = rng();
+      b = rng();
 #else
-    auto a{rand()};
-    auto b{rand()};
+      a = rand();
+      b = rand();
 #endif
+    }
     if (bucket.contains({a, b}))
       continue;
     auto target = engine.getBucketCRC32c(a, b);
@@ -111,6 +180,9 @@ int bench(const std::string_view name, const std::string &filename,
   }
 
   uint32_t misplaced{0};
+  if (counters) {
+    counters->start();
+  }
   for (const auto &i : bucket) {
     auto oldbucket = i.second;
     auto a{i.first.first};
@@ -124,6 +196,9 @@ int bench(const std::string_view name, const std::string &filename,
       ++misplaced;
     }
   }
+  if (counters) {
+    counters->stop();
+  }
 
   double m = (double)misplaced / (num_keys);
 #ifdef USE_PCG32
@@ -147,6 +222,9 @@ int bench(const std::string_view name, const std::string &filename,
   bucket_status[anode] = 1;
   fmt::println("Added node {}", anode);
 
+  if (counters) {
+    counters->start();
+  }
   for (const auto &i : bucket) {
     auto oldbucket = i.second;
     auto a{i.first.first};
@@ -160,6 +238,9 @@ int bench(const std::string_view name, const std::string &filename,
       ++misplaced;
     }
   }
+  if (counters) {
+    counters->stop();
+  }
 
   m = (double)misplaced / (num_keys);
 
@@ -181,6 +262,203 @@ int bench(const std::string_view name, const std::string &filename,
 
   ////////////////////////////////////////////////////////////////////
 
+  if (counters) {
+    fmt::println("{}: Per lookup (after removal and after adding back): {}",
+                 name, counters->report(2 * static_cast<uint64_t>(num_keys)));
+  }
+
+  results_file.close();
+
+  delete[] bucket_status;
+
+  return 0;
+}
+
+/*
+ * Replicas benchmark routine: after removing a bucket only the replica
+ * on that bucket should change, after adding it back no replica should
+ * change
+ */
+template <typename Algorithm>
+int bench_replicas(const std::string_view name, const std::string &filename,
+                   uint32_t anchor_set, uint32_t working_set,
+                   uint32_t num_removals, uint32_t num_keys,
+                   uint32_t replicas, const std::string &key_source,
+                   uint32_t keyspace, uint64_t seed, bool perf,
+                   const std::vector<uint32_t> &weights) {
+
+  auto engine = make_engine<Algorithm>(anchor_set, working_set, weights);
+
+  std::optional<PerfCounters> counters;
+  if (perf) {
+    counters.emplace();
+  }
+
+  std::optional<KeySource> source;
+  if (key_source != "rand") {
+    source.emplace(key_source, keyspace, seed);
+    fmt::println("Keys: {}, KeySpace: {}, Seed: {}", key_source, keyspace,
+                 source->seed());
+    if (source->distinctKeys() < num_keys) {
+      fmt::println("The key source cannot produce {} unique keys", num_keys);
+      return 2;
+    }
+  }
+  /*
+   * Monotonicity does not depend on the popularity of the keys: the
+   * distinct keys of a finite source are enumerated by id instead of drawn
+   * (which would need a very long time to find all the rare ones)
+   */
+  const bool finite{source && source->distinctKeys() != UINT64_MAX};
+
+  // random removals
+  uint32_t *bucket_status = new uint32_t[anchor_set]();
+
+  // all nodes are working
+  for (uint32_t i = 0; i < working_set; i++) {
+    bucket_status[i] = 1;
+  }
+
+  // simulate num_removals removals
+  uint32_t i = 0;
+  while (i < num_removals) {
+#ifdef USE_PCG32
+    uint32_t removed = rng() % working_set;
+#else
+    uint32_t removed = rand() % working_set;
+#endif
+    if (bucket_status[removed] == 1) {
+      auto rnode = engine.removeBucket(removed);
+      bucket_status[rnode] = 0; // Remove the actually removed node
+      i++;
+    }
+  }
+
+  // key -> index of its replicas in the replica array
+  boost::unordered_flat_map<std::pair<uint32_t, uint32_t>, uint32_t> index;
+  std::vector<uint32_t> replica(static_cast<size_t>(num_keys) * replicas);
+  std::ofstream results_file;
+  results_file.open(filename, std::ofstream::out | std::ofstream::app);
+
+  // Determine the current key replicas assigment
+  for (uint32_t i = 0; i < num_keys;) {
+    uint32_t a, b;
+    if (source) {
+      auto k = finite ? source->key(i) : source->next();
+      a = k.key;
+      b = k.seed;
+    } else {
+#ifdef USE_PCG32
+      a = rng();
+      b = rng();
+#else
+      a = rand();
+      b = rand();
+#endif
+    }
+    if (index.contains({a, b}))
+      continue;
+    auto *r = &replica[static_cast<size_t>(i) * replicas];
+    if (engine.getReplicasCRC32c(a, b, replicas, r) != replicas) {
+      throw "Not enough buckets";
+    }
+    for (uint32_t j = 0; j < replicas; ++j) {
+      // Verify that we got working buckets
+      if (!bucket_status[r[j]]) {
+        throw "Crazy bug";
+      }
+    }
+    index[{a, b}] = i;
+    ++i;
+  }
+  fmt::println("Done determining initial replicas of {} unique keys",
+               num_keys);
+
+  // Counts the replicas in the old assignment that are not in the new one
+  std::vector<uint32_t> out(replicas);
+  auto changed = [&](const std::pair<uint32_t, uint32_t> &key,
+                     const uint32_t *old) {
+    engine.getReplicasCRC32c(key.first, key.second, replicas, out.data());
+    uint32_t c{0};
+    for (uint32_t j = 0; j < replicas; ++j) {
+      c += std::find(out.begin(), out.end(), old[j]) == out.end();
+    }
+    return c;
+  };
+
+  // Remove a random working node
+  uint32_t removed{0};
+  uint32_t rnode{0};
+  for (;;) {
+#ifdef USE_PCG32
+    removed = rng() % working_set;
+#else
+    removed = rand() % working_set;
+#endif
+    if (bucket_status[removed] == 1) {
+      rnode = engine.removeBucket(removed);
+      fmt::println("Removed node {}", rnode);
+      if (!bucket_status[rnode]) {
+        throw "Crazy bug";
+      }
+      bucket_status[rnode] = 0; // Remove the actually removed node
+      break;
+    }
+  }
+
+  uint64_t misplaced{0};
+  if (counters) {
+    counters->start();
+  }
+  for (const auto &i : index) {
+    const auto *old = &replica[static_cast<size_t>(i.second) * replicas];
+    auto expected = std::find(old, old + replicas, rnode) != old + replicas;
+    misplaced += changed(i.first, old) - expected;
+  }
+  if (counters) {
+    counters->stop();
+  }
+
+  double m = (double)misplaced / (static_cast<double>(num_keys) * replicas);
+  fmt::println("{}: after removal misplaced replicas are {}% ({} replicas out "
+               "of {})",
+               name, m * 100, misplaced,
+               static_cast<uint64_t>(num_keys) * replicas);
+  results_file << name << ": "
+               << "MisplacedReplicasRem: " << misplaced << "\t" << num_keys
+               << "\t" << replicas << "\t" << m << "\n";
+
+  misplaced = 0;
+  // Add back a node
+  auto anode = engine.addBucket();
+  bucket_status[anode] = 1;
+  fmt::println("Added node {}", anode);
+
+  if (counters) {
+    counters->start();
+  }
+  for (const auto &i : index) {
+    misplaced +=
+        changed(i.first, &replica[static_cast<size_t>(i.second) * replicas]);
+  }
+  if (counters) {
+    counters->stop();
+  }
+
+  m = (double)misplaced / (static_cast<double>(num_keys) * replicas);
+  fmt::println("{}: after adding back misplaced replicas are {}% ({} replicas "
+               "out of {})",
+               name, m * 100, misplaced,
+               static_cast<uint64_t>(num_keys) * replicas);
+  results_file << name << ": "
+               << "MisplacedReplicasAdd: " << misplaced << "\t" << num_keys
+               << "\t" << replicas << "\t" << m << "\n";
+
+  if (counters) {
+    fmt::println("{}: Per lookup (after removal and after adding back): {}",
+                 name, counters->report(2 * static_cast<uint64_t>(num_keys)));
+  }
+
   results_file.close();
 
   delete[] bucket_status;
@@ -188,27 +466,299 @@ int bench(const std::string_view name, const std::string &filename,
   return 0;
 }
 
+/*
+ * Parses a sequence of membership changes such as "r3,a,r2,a2" (three
+ * removals, one addition, two removals, two additions) into one
+ * character per change
+ */
+std::string parse_steps(const std::string &spec) {
+  std::string steps;
+  size_t start{0};
+  while (start < spec.size()) {
+    auto end = std::min(spec.find(',', start), spec.size());
+    auto step = spec.substr(start, end - start);
+    if (step.empty() || (step[0] != 'r' && step[0] != 'a')) {
+      throw std::invalid_argument{"Unknown step " + step};
+    }
+    steps.append(step.size() > 1 ? std::stoul(step.substr(1)) : 1, step[0]);
+    start = end + 1;
+  }
+  return steps;
+}
+
+/*
+ * Storage-free benchmark routine: keys are regenerated from a counter, and
+ * two engines that went through the same changes (up to the previous step
+ * and up to the current one) give the assignment of each key before and
+ * after every change, so nothing is stored and NumKeys is only bounded by
+ * time. Keys are checked in parallel chunks.
+ * After removing a bucket only its keys may move, after adding a bucket
+ * keys may only move to it. With plan, the moves of each step are also
+ * enumerated with the migration planner, which must find the same number.
+ */
+template <typename Algorithm>
+int bench_streaming(const std::string_view name, const std::string &filename,
+                    uint32_t anchor_set, uint32_t working_set,
+                    uint32_t num_removals, uint64_t num_keys,
+                    const std::string &steps, uint32_t threads,
+                    uint64_t seed, bool plan,
+                    const std::vector<uint32_t> &weights) {
+  constexpr uint64_t CHUNK = 1 << 16;
+  constexpr uint32_t MAX_REPORTED = 10;
+
+  auto before = make_engine<Algorithm>(anchor_set, working_set, weights);
+  auto after = make_engine<Algorithm>(anchor_set, working_set, weights);
+  CounterKeys keys{seed};
+  std::mt19937_64 rng{keys.seed()};
+  fmt::println("Keys: counter, Seed: {}, Threads: {}, Steps: {}", keys.seed(),
+               threads, steps);
+
+  // working buckets (for random removals) and their status
+  std::vector<uint32_t> working(working_set);
+  std::vector<uint8_t> bucket_status(std::max(anchor_set, working_set));
+  for (uint32_t i = 0; i < working_set; i++) {
+    working[i] = i;
+    bucket_status[i] = 1;
+  }
+  // Applies a change to the engine after: returns the requested bucket
+  // (for the engine before) and the bucket actually removed or added
+  auto change = [&](char step) -> std::pair<uint32_t, uint32_t> {
+    if (step == 'r') {
+      auto removed = working[rng() % working.size()];
+      auto b = after.removeBucket(removed);
+      if (!bucket_status[b]) {
+        throw "Crazy bug";
+      }
+      bucket_status[b] = 0;
+      working.erase(std::find(working.begin(), working.end(), b));
+      return {removed, b};
+    }
+    auto b = after.addBucket();
+    if (b >= bucket_status.size()) {
+      bucket_status.resize(b + 1);
+    }
+    bucket_status[b] = 1;
+    working.push_back(b);
+    return {b, b};
+  };
+  // Applies the same change to the engine before
+  auto catch_up = [&](char step, std::pair<uint32_t, uint32_t> node) {
+    auto b = step == 'r' ? before.removeBucket(node.first) : before.addBucket();
+    if (b != node.second) {
+      throw "Crazy bug";
+    }
+  };
+
+  // simulate num_removals removals
+  for (uint32_t i = 0; i < num_removals && working.size() > 1; ++i) {
+    catch_up('r', change('r'));
+  }
+
+  std::ofstream results_file;
+  results_file.open(filename, std::ofstream::out | std::ofstream::app);
+
+  for (size_t s = 0; s < steps.size(); ++s) {
+    if (steps[s] == 'r' && working.size() < 2) {
+      fmt::println("Cannot remove the last working bucket");
+      return 2;
+    }
+    auto w = working.size();
+    const bool removal = steps[s] == 'r';
+    const auto changed = change(steps[s]);
+    const auto node = changed.second;
+    fmt::println("Step {}: {} node {}", s + 1, removal ? "removed" : "added",
+                 node);
+
+    std::atomic<uint64_t> next{0};
+    std::atomic<uint32_t> reported{0};
+    std::mutex print;
+    std::vector<uint64_t> moved(threads), misplaced(threads);
+    auto check = [&](uint32_t t) {
+      pin_to_core(t);
+      uint64_t m{0}, bad{0};
+      for (;;) {
+        const auto first = next.fetch_add(CHUNK, std::memory_order_relaxed);
+        if (first >= num_keys) {
+          break;
+        }
+        const auto last = std::min(first + CHUNK, num_keys);
+        for (auto i = first; i < last; ++i) {
+          const auto k = keys[i];
+          const auto oldbucket = before.getBucketCRC32c(k.key, k.seed);
+          const auto newbucket = after.getBucketCRC32c(k.key, k.seed);
+          if (oldbucket == newbucket && bucket_status[newbucket]) {
+            continue;
+          }
+          ++m;
+          if (bucket_status[newbucket] &&
+              (removal ? oldbucket == node : newbucket == node)) {
+            continue;
+          }
+          ++bad;
+          if (reported.fetch_add(1, std::memory_order_relaxed) <
+              MAX_REPORTED) {
+            std::lock_guard lock{print};
+            fmt::println("(Step {}) Misplaced key {},{}: before in bucket {}, "
+                         "now in bucket {} (status? new bucket {})",
+                         s + 1, k.key, k.seed, oldbucket, newbucket,
+                         bucket_status[newbucket]);
+          }
+        }
+      }
+      moved[t] = m;
+      misplaced[t] = bad;
+    };
+    Stopwatch stopwatch;
+    std::vector<std::thread> workers;
+    for (uint32_t t = 1; t < threads; ++t) {
+      workers.emplace_back(check, t);
+    }
+    check(0);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    auto elapsed = stopwatch.seconds();
+
+    uint64_t total_moved{0}, total_misplaced{0};
+    for (uint32_t t = 0; t < threads; ++t) {
+      total_moved += moved[t];
+      total_misplaced += misplaced[t];
+    }
+    // a removal should move 1/w of the keys, an addition 1/(w+1)
+    double expected = 1.0 / (removal ? w : w + 1);
+    double m = (double)total_moved / num_keys;
+    double bad = (double)total_misplaced / num_keys;
+    fmt::println("{}: after step {} ({}) moved keys are {}% (expected {}%), "
+                 "misplaced keys are {}% ({} keys out of {}) in {:.1f}s",
+                 name, s + 1, removal ? "removal" : "addition", m * 100,
+                 expected * 100, bad * 100, total_misplaced, num_keys,
+                 elapsed);
+    results_file << name << ": "
+                 << (removal ? "MisplacedStepRem: " : "MisplacedStepAdd: ")
+                 << total_misplaced << "\t" << num_keys << "\t" << bad << "\t"
+                 << m << "\t" << expected << "\tcounter\n";
+
+    if (plan) {
+      MigrationPlanner<Algorithm> planner{before, after, threads};
+      removal ? planner.removed(node) : planner.added(node);
+      uint64_t planned{0};
+      stopwatch.restart();
+      auto summary = planner.plan(keys, num_keys,
+                                  [&](std::span<const Move> moves) {
+                                    planned += moves.size();
+                                  });
+      elapsed = stopwatch.seconds();
+      fmt::println("{}: planned {} moves with {:.4f} lookups per key in "
+                   "{:.1f}s{}",
+                   name, planned, (double)summary.lookups / summary.keys,
+                   elapsed,
+                   planned == total_moved ? "" : " (different from the check!)");
+      if (planned != total_moved) {
+        return 1;
+      }
+    }
+
+    catch_up(steps[s], changed);
+  }
+
+  results_file.close();
+
+  return 0;
+}
+
+/*
+ * Runs the benchmark, the storage-free benchmark if steps are given or,
+ * with more than one replica, the replicas benchmark
+ */
+template <typename Algorithm>
+int run(const std::string_view name, const std::string &filename,
+        uint32_t anchor_set, uint32_t working_set, uint32_t num_removals,
+        uint64_t num_keys, uint32_t replicas, const std::string &key_source,
+        uint32_t keyspace, uint64_t seed, bool perf, const std::string &steps,
+        uint32_t threads, bool plan, const std::vector<uint32_t> &weights) {
+  if (!steps.empty()) {
+    return bench_streaming<Algorithm>(name, filename, anchor_set, working_set,
+                                      num_removals, num_keys, steps, threads,
+                                      seed, plan, weights);
+  }
+  if (num_keys > UINT32_MAX) {
+    fmt::println("More than 2^32 keys require --steps");
+    return 2;
+  }
+  auto keys = static_cast<uint32_t>(num_keys);
+  if (replicas > 1) {
+    if constexpr (requires(Algorithm &e, uint32_t *out) {
+                    e.getReplicasCRC32c(0, 0, 1, out);
+                  }) {
+      return bench_replicas<Algorithm>(name, filename, anchor_set, working_set,
+                                       num_removals, keys, replicas,
+                                       key_source, keyspace, seed, perf,
+                                       weights);
+    } else {
+      fmt::println("{} does not support replicas", name);
+      return 2;
+    }
+  }
+  return bench<Algorithm>(name, filename, anchor_set, working_set,
+                          num_removals, keys, key_source, keyspace, seed,
+                          perf, weights);
+}
+
+/*
+ * The algorithms of the benchmark
+ */
+using Algorithms =
+    Engines::With<WeightedEngine<MementoEngine<boost::unordered_flat_map>>,
+                  WeightedEngine<AnchorEngine>>;
+
 int main(int argc, char *argv[]) {
   cxxopts::Options options("speed_test", "MementoHash vs AnchorHash benchmark");
   options.add_options()("Algorithm",
-                        "Algorithm "
-                        "(null|baseline|anchor|memento|mementoboost|"
-                        "mementomash|mementostd|mementogtl|jump|power)",
+                        "Algorithm (null|baseline|" + Algorithms::names() +
+                            ")",
                         cxxopts::value<std::string>())(
       "AnchorSet", "Size of the AnchorSet (ignored by Memento)",
       cxxopts::value<int>())("WorkingSet", "Size of the WorkingSet",
                              cxxopts::value<int>())(
       "NumRemovals", "Number of random removals", cxxopts::value<int>())(
       "NumKeys", "Number of keys to lookup for",
-      cxxopts::value<int>())("ResFileName", "Number of keys to lookup for",
-                             cxxopts::value<std::string>());
+      cxxopts::value<uint64_t>())("ResFileName", "Number of keys to lookup for",
+                             cxxopts::value<std::string>())(
+      "replicas", "Number of distinct buckets to lookup for each key",
+      cxxopts::value<int>()->default_value("1"))(
+      "keys", "Key source (rand|uniform|zipf:S|hotspot:F:P|sequential)",
+      cxxopts::value<std::string>()->default_value("rand"))(
+      "keyspace", "Number of distinct keys (zipf and hotspot)",
+      cxxopts::value<int>()->default_value("1000000"))(
+      "seed", "Seed for keys and removals (0 means random)",
+      cxxopts::value<uint64_t>()->default_value("0"))(
+      "perf",
+      "Read hardware performance counters around the lookups after the "
+      "removal and after adding back, and report them per lookup",
+      cxxopts::value<bool>()->default_value("false"))(
+      "steps",
+      "Check a sequence of removals and additions (e.g. r3,a,r2,a2) without "
+      "storing the keys, which are generated from a counter",
+      cxxopts::value<std::string>()->default_value(""))(
+      "threads",
+      "Number of threads checking the keys with --steps (0 means one per "
+      "core)",
+      cxxopts::value<int>()->default_value("1"))(
+      "plan",
+      "With --steps, also enumerate the moved keys of each step with the "
+      "migration planner",
+      cxxopts::value<bool>()->default_value("false"))(
+      "weights",
+      "Comma separated bucket weights, repeated over the buckets "
+      "(weighted algorithms only)",
+      cxxopts::value<std::string>()->default_value(""));
 
   options.positional_help(
       "Algorithm AnchorSet WorkingSet NumRemovals Numkeys ResFilename");
   options.parse_positional({"Algorithm", "AnchorSet", "WorkingSet",
                             "NumRemovals", "NumKeys", "ResFileName"});
   auto result = options.parse(argc, argv);
-  if (argc != 7) {
+  if (!result.count("ResFileName")) {
     fmt::println("{}", options.help());
     exit(1);
   }
@@ -217,15 +767,27 @@ int main(int argc, char *argv[]) {
   auto anchor_set = static_cast<uint32_t>(result["AnchorSet"].as<int>());
   auto working_set = static_cast<uint32_t>(result["WorkingSet"].as<int>());
   auto num_removals = static_cast<uint32_t>(result["NumRemovals"].as<int>());
-  auto num_keys = static_cast<uint32_t>(result["NumKeys"].as<int>());
+  auto num_keys = result["NumKeys"].as<uint64_t>();
   auto filename = result["ResFileName"].as<std::string>();
+  auto replicas = static_cast<uint32_t>(result["replicas"].as<int>());
+  auto key_source = result["keys"].as<std::string>();
+  auto keyspace = static_cast<uint32_t>(result["keyspace"].as<int>());
+  auto seed = result["seed"].as<uint64_t>();
+  auto perf = result["perf"].as<bool>();
+  auto steps = parse_steps(result["steps"].as<std::string>());
+  auto threads = static_cast<uint32_t>(result["threads"].as<int>());
+  auto plan = result["plan"].as<bool>();
+  auto weights = parsePositiveList(result["weights"].as<std::string>());
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
 
   fmt::println("Algorithm: {}, AnchorSet: {}, WorkingSet: {}, NumRemovals: {}, "
                "NumKeys: {}, ResFileName: {}",
                algorithm, anchor_set, working_set, num_removals, num_keys,
                filename);
 
-  srand(time(NULL));
+  srand(seed ? seed : time(NULL));
 
   if (algorithm == "null") {
     // do nothing
@@ -245,37 +807,13 @@ int main(int argc, char *argv[]) {
       }
     }
     delete[] bucket_status;
-  } else if (algorithm == "anchor") {
-    return bench<AnchorEngine>("Anchor", filename, anchor_set, working_set,
-                               num_removals, num_keys);
-  } else if (algorithm == "memento") {
-    return bench<MementoEngine<boost::unordered_flat_map>>(
-        "Memento<boost::unordered_flat_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementoboost") {
-    return bench<MementoEngine<boost::unordered_map>>(
-        "Memento<boost::unordered_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementostd") {
-    return bench<MementoEngine<std::unordered_map>>(
-        "Memento<std::unordered_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementogtl") {
-    return bench<MementoEngine<gtl::flat_hash_map>>(
-        "Memento<std::gtl::flat_hash_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementomash") {
-    return bench<MementoEngine<MashTable>>("Memento<MashTable>", filename,
-                                           anchor_set, working_set,
-                                           num_removals, num_keys);
-  } else if (algorithm == "jump") {
-    return bench<JumpEngine>("JumpEngine", filename, anchor_set, working_set,
-                             num_removals, num_keys);
-  } else if (algorithm == "power") {
-    return bench<PowerEngine>("PowerEngine", filename, anchor_set, working_set,
-                              num_removals, num_keys);
   } else {
-    fmt::println("Unknown algorithm {}", algorithm);
-    return 2;
+    return Algorithms::dispatch(
+        algorithm, [&]<typename Algorithm>(const std::string &name) {
+          return run<Algorithm>(name, filename, anchor_set, working_set,
+                              num_removals, num_keys, replicas, key_source,
+                              keyspace, seed, perf, steps, threads, plan,
+                              weights);
+        });
   }
 }
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NODETABLE_H
+#define NODETABLE_H
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Maps the buckets of any engine (MementoEngine, AnchorEngine, ...) to node
+ * records (e.g. the address of a server), so that a lookup returns the
+ * node without a separate bucket->node hash map.
+ * <p>
+ * Records are stored in a dense array indexed by bucket. Each slot is
+ * padded to a power of two and the array is cache-line aligned, so a record
+ * never spans two cache lines: resolving a node costs one more cache line
+ * after the bucket. The table is updated by addBucket and removeBucket,
+ * together with the engine; like the engine, membership changes must not
+ * run concurrently with lookups (see concurrent/syncengine.h).
+ *
+ * @tparam Engine the wrapped engine
+ * @tparam Node   the node record (at most 64 bytes, default constructible)
+ */
+template <typename Engine, typename Node> class NodeTableEngine final {
+  static_assert(sizeof(Node) <= 64, "A node record must fit a cache line");
+
+  struct alignas(std::bit_ceil(std::max(sizeof(Node), alignof(Node)))) Slot
+      final {
+    Node m_node{};
+  };
+
+  /* Number of buckets resolved before their slots are read */
+  static constexpr size_t PREFETCH_BATCH = 16;
+
+public:
+  NodeTableEngine(uint32_t anchor_set, uint32_t working_set)
+      : m_engine{anchor_set, working_set},
+        m_length{std::max({anchor_set, working_set, 1u})},
+        m_slots{new Slot[m_length]} {}
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept {
+    return m_engine.getBucketCRC32c(key, seed);
+  }
+
+  /**
+   * Returns the node where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the node of the related bucket
+   */
+  const Node &getNodeCRC32c(uint64_t key, uint64_t seed) const noexcept {
+    return m_slots[m_engine.getBucketCRC32c(key, seed)].m_node;
+  }
+
+  /**
+   * Returns the buckets where the given keys should be mapped. With
+   * prefetch, the node records of the buckets are prefetched, so that
+   * reading them afterwards does not wait for memory.
+   *
+   * @param keys the keys to map
+   * @param seeds the initial seeds for CRC32c (one per key)
+   * @param count the number of keys
+   * @param out the resulting buckets (at least count elements)
+   * @param prefetch true to prefetch the node records
+   */
+  void getBucketsCRC32c(const uint64_t *keys, const uint64_t *seeds,
+                        size_t count, uint32_t *out,
+                        bool prefetch = false) const noexcept {
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = m_engine.getBucketCRC32c(keys[i], seeds[i]);
+      if (prefetch) {
+        __builtin_prefetch(&m_slots[out[i]]);
+      }
+    }
+  }
+
+  /**
+   * Returns the nodes where the given keys should be mapped. Buckets are
+   * resolved in groups and the records of a group are prefetched before
+   * being read, so that the memory accesses overlap.
+   *
+   * @param keys the keys to map
+   * @param seeds the initial seeds for CRC32c (one per key)
+   * @param count the number of keys
+   * @param out the resulting nodes (at least count elements)
+   */
+  void getNodesCRC32c(const uint64_t *keys, const uint64_t *seeds,
+                      size_t count, const Node **out) const noexcept {
+    uint32_t buckets[PREFETCH_BATCH];
+    for (size_t i = 0; i < count; i += PREFETCH_BATCH) {
+      const auto n = std::min(PREFETCH_BATCH, count - i);
+      getBucketsCRC32c(keys + i, seeds + i, n, buckets, true);
+      for (size_t j = 0; j < n; ++j) {
+        out[i + j] = &m_slots[buckets[j]].m_node;
+      }
+    }
+  }
+
+  /**
+   * Adds a new bucket to the engine and assigns it a node.
+   *
+   * @param node the node of the new bucket
+   * @return the added bucket
+   */
+  uint32_t addBucket(const Node &node) {
+    auto b = m_engine.addBucket();
+    if (b >= m_length) {
+      auto length{std::max(b + 1, m_length << 1)};
+      std::unique_ptr<Slot[]> slots{new Slot[length]};
+      std::copy(m_slots.get(), m_slots.get() + m_length, slots.get());
+      m_slots = std::move(slots);
+      m_length = length;
+    }
+    m_slots[b].m_node = node;
+    return b;
+  }
+
+  /**
+   * Adds a new bucket to the engine with a default node, to be assigned
+   * with setNode.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() { return addBucket(Node{}); }
+
+  /**
+   * Removes the given bucket from the engine and clears its node.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket (whose node is cleared)
+   */
+  uint32_t removeBucket(uint32_t bucket) noexcept {
+    auto b = m_engine.removeBucket(bucket);
+    m_slots[b].m_node = Node{};
+    return b;
+  }
+
+  /**
+   * Assigns a node to a bucket (e.g. the initial working buckets).
+   *
+   * @param bucket the bucket
+   * @param node the node
+   */
+  void setNode(uint32_t bucket, const Node &node) noexcept {
+    m_slots[bucket].m_node = node;
+  }
+
+  /**
+   * Returns the node of a bucket.
+   *
+   * @param bucket the bucket
+   * @return the node of the bucket
+   */
+  const Node &node(uint32_t bucket) const noexcept {
+    return m_slots[bucket].m_node;
+  }
+
+  /**
+   * Returns the wrapped engine.
+   *
+   * @return the engine
+   */
+  const Engine &engine() const noexcept { return m_engine; }
+
+private:
+  Engine m_engine;
+  uint32_t m_length;
+  std::unique_ptr<Slot[]> m_slots;
+};
+
+#endif // NODETABLE_H
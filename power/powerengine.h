@@ -18,6 +18,8 @@
 #include <cmath>
 #include <cstdint>
 #include "pcg_random.hpp"
+#include "../hash/crc32c.h"
+#include "../stats/hopstats.h"
 
 class PowerEngine final {
 public:
@@ -25,14 +27,6 @@ public:
         : m_n{working_nodes}, m_m{smallestPow2(m_n)}, m_mH{m_m >> 1}, m_mHm1{m_mH - 1}, m_mm1{m_m - 1}
     {}
 
-    // From AnchorHash
-    static uint32_t crc32c_sse42_u64(uint64_t key, uint64_t seed) {
-        __asm__ volatile("crc32q %[key], %[seed];"
-                         : [seed] "+r"(seed)
-                         : [key] "rm"(key));
-        return seed;
-    }
-
     /**
    * Returns the bucket where the given key should be mapped.
    * This implementations is the same as provided by Power authors
@@ -41,22 +35,40 @@ public:
    * @param seed the initial seed for CRC32c
    * @return the related bucket
    */
-    uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) noexcept
+    uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept
     {
-        pcg32 rng;
-        auto k = crc32c_sse42_u64(key, seed);
-        // r1 = f (key, m) (we pass m-1 because f expects that)
-        auto r1 = f(k, m_mm1, rng);
-        if (r1 < m_n) {
-            return r1;
-        }
-        // r2 = g(key, n, m/2 − 1)
-        auto r2 = g(k, m_n, m_mHm1, rng);
-        if (r2 > m_mHm1) {
-            return r2;
+        return power(crc32c_sse42_u64(key, seed));
+    }
+
+    /**
+   * Returns count distinct buckets where the given key should be
+   * replicated. The first one is the bucket returned by getBucketCRC32c.
+   * The candidates come from a single stream of hashes, each derived from
+   * the previous one with one CRC32c step, and duplicates are skipped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @param count the number of replicas
+   * @param out the resulting buckets (at least count elements)
+   * @return the number of replicas, that is min(count, number of buckets)
+   */
+    uint32_t getReplicasCRC32c(uint64_t key, uint64_t seed, uint32_t count,
+                               uint32_t *out) const noexcept
+    {
+        count = count < m_n ? count : m_n;
+        uint32_t k = crc32c_sse42_u64(key, seed);
+        for (uint32_t n = 0; n < count;) {
+            const auto b = power(k);
+            uint32_t i = 0;
+            while (i < n && out[i] != b) {
+                ++i;
+            }
+            if (i == n) {
+                out[n++] = b;
+            }
+            k = crc32c_sse42_u64(k, key);
         }
-        // f (key, m/2) (we pass m/2-1 because f expects that)
-        return f(k, m_mHm1, rng);
+        return count;
     }
 
     /**
@@ -90,6 +102,29 @@ public:
 
 private:
 
+    /**
+     * Maps the hash of a key to a bucket
+     *
+     * @param k the hash of the key
+     * @return the related bucket
+     */
+    uint32_t power(uint32_t k) const noexcept
+    {
+        pcg32 rng;
+        // r1 = f (key, m) (we pass m-1 because f expects that)
+        auto r1 = f(k, m_mm1, rng);
+        if (r1 < m_n) {
+            return r1;
+        }
+        // r2 = g(key, n, m/2 − 1)
+        auto r2 = g(k, m_n, m_mHm1, rng);
+        if (r2 > m_mHm1) {
+            return r2;
+        }
+        // f (key, m/2) (we pass m/2-1 because f expects that)
+        return f(k, m_mHm1, rng);
+    }
+
     static uint32_t smallestPow2(uint32_t x) {
         --x;
         x |= x >> 1;
@@ -137,7 +172,9 @@ private:
      */
     static uint32_t g(uint32_t key, uint32_t n, uint32_t s, pcg32& rng) {
         auto x = s; // (...) Initially, x is set to the value of s
+        HOPSTATS_DECLARE(hops);
         for (;;) {
+            HOPSTATS_INCREMENT(hops);
             // (...) 1. Generate U
             //          U denotes the next random number from a generator U (0, 1)
             //          that generates random numbers
@@ -151,6 +188,7 @@ private:
             } else {
                 // (...) Otherwise, the algorithm returns the current
                 // value of x as the result
+                HOPSTATS_RECORD(PowerG, hops);
                 return x;
             }
         }
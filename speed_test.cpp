@@ -15,14 +15,32 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "anchor/anchorengine.h"
+#include "bench/affinity.h"
+#include "bench/histogram.h"
+#include "bench/keysource.h"
+#include "bench/lists.h"
+#include "bench/perfcounters.h"
+#include "bench/registry.h"
+#include "bench/timing.h"
+#include "hash/crc32c.h"
 #include "memento/mashtable.h"
 #include "memento/mementoengine.h"
 #include "jump/jumpengine.h"
+#include "migration/dualepoch.h"
+#include "node/nodetable.h"
 #include "power/powerengine.h"
+#include "stats/heapstats.h"
+#include "stats/hopstats.h"
+#include "cache/cachedengine.h"
+#include "weighted/weightedengine.h"
 #ifdef USE_PCG32
 #include "pcg_random.hpp"
 #include <random>
 #endif
+#include <algorithm>
+#include <barrier>
+#include <chrono>
+#include <cstring>
 #include <boost/unordered/unordered_flat_map.hpp>
 #include <boost/unordered_map.hpp>
 #include <cxxopts.hpp>
@@ -30,6 +48,9 @@
 #include <fstream>
 #include <unordered_map>
 #include <gtl/phmap.hpp>
+#include <optional>
+#include <thread>
+#include <vector>
 
 /*
  * ******************************************
@@ -38,64 +59,162 @@
  */
 
 #ifdef USE_HEAPSTATS
-static unsigned long allocations{0};
-static unsigned long deallocations{0};
-static unsigned long allocated{0};
-static unsigned long deallocated{0};
-static unsigned long maximum{0};
-
-void *operator new(size_t size) {
-  void *p = malloc(size);
-  allocations += 1;
-  allocated += size;
-  maximum = allocated > maximum ? allocated : maximum;
-  return p;
+/* The heap counters when the measurement started */
+static heapstats::Snapshot heap_start;
+
+void reset_memory_stats() noexcept {
+  heapstats::resetPeak();
+  heap_start = heapstats::snapshot();
 }
 
-void *operator new[](size_t size) {
-  void *p = malloc(size);
-  allocations += 1;
-  allocated += size;
-  maximum = allocated > maximum ? allocated : maximum;
-  return p;
+/*
+ * Returns the heap counters since reset_memory_stats (the peak is the
+ * largest live heap)
+ */
+heapstats::Snapshot memory_stats() noexcept {
+  auto s{heapstats::snapshot()};
+  s.allocations -= heap_start.allocations;
+  s.deallocations -= heap_start.deallocations;
+  s.requested -= heap_start.requested;
+  s.live -= heap_start.live;
+  s.peak -= heap_start.live;
+  return s;
 }
 
-void operator delete(void *ptr, std::size_t size) noexcept {
-  deallocations += 1;
-  deallocated += size;
-  free(ptr);
+void print_memory_stats(std::string_view label) noexcept {
+  auto s{memory_stats()};
+  fmt::println("   @{}: Allocations: {}, Requested: {}, Deallocations: {}, "
+               "Live: {}, Maximum: {}, PeakRSS: {}",
+               label, s.allocations, s.requested, s.deallocations, s.live,
+               s.peak, heapstats::peakRss());
 }
+#endif
 
-void operator delete[](void *ptr, std::size_t size) noexcept {
-  deallocations += 1;
-  deallocated += size;
-  free(ptr);
+/*
+ * ******************************************
+ * Benchmark parameters
+ * ******************************************
+ */
+struct BenchOptions final {
+  std::string filename;
+  uint32_t anchor_set;
+  uint32_t working_set;
+  uint32_t num_removals;
+  uint32_t num_keys;
+  std::vector<uint32_t> weights;
+  uint32_t replicas;
+  /* Pre-generated keys (empty when keys are drawn with rand()) */
+  std::vector<Key> keys;
+  std::string key_source;
+  uint32_t keyspace;
+  uint64_t seed;
+  bool wall;
+  /* Thread counts of the scaling benchmark (empty to run single-threaded) */
+  std::vector<uint32_t> threads;
+  /* CSV file of the latency histogram (empty to skip latency sampling) */
+  std::string latency_file;
+  /* Time one lookup every latency_sample lookups */
+  uint32_t latency_sample;
+  /* Read the hardware performance counters around the lookup loop */
+  bool perf;
+  /* Order of the removals (random|ascending|descending) */
+  std::string removal_order;
+  /* Removals from the old epoch to the new one (0 to skip the dual-epoch
+   * benchmark) */
+  uint32_t epoch_removals;
+  /* Keys per batch of the batch benchmark (0 to skip it) */
+  uint32_t batch;
+  /* Resolve keys to node records (node benchmark) */
+  bool nodes;
+  /* Length of the keys of the string key benchmark (0 to skip it) */
+  uint32_t key_bytes;
+};
+
+/*
+ * Returns the i-th bucket to remove, or working_set for random removals
+ */
+inline uint32_t ordered_removal(const std::string &order, uint32_t working_set,
+                                uint32_t i) noexcept {
+  if (order == "ascending") {
+    return i;
+  }
+  if (order == "descending") {
+    return working_set - 1 - i;
+  }
+  return working_set;
 }
 
-void reset_memory_stats() noexcept {
-  allocations = 0;
-  allocated = 0;
-  deallocations = 0;
-  deallocated = 0;
-  maximum = 0;
+/*
+ * Times one lookup every sample_every lookups over the given keys, with the
+ * same lookup as the benchmark loop (replicas included)
+ */
+template <typename Algorithm>
+LatencyHistogram sample_latency(Algorithm &engine, const std::vector<Key> &keys,
+                                uint32_t replicas, uint32_t sample_every) {
+  LatencyHistogram histogram;
+  volatile int64_t bucket{0};
+  std::vector<uint32_t> out(std::max(replicas, 1u));
+  auto lookup = [&](const Key &k) {
+    if constexpr (requires(uint32_t *o) {
+                    engine.getReplicasCRC32c(0, 0, 1, o);
+                  }) {
+      if (replicas > 1) {
+        engine.getReplicasCRC32c(k.key, k.seed, replicas, out.data());
+        bucket = out[replicas - 1];
+        return;
+      }
+    }
+    bucket = engine.getBucketCRC32c(k.key, k.seed);
+  };
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (i % sample_every) {
+      lookup(keys[i]);
+      continue;
+    }
+    auto start{std::chrono::steady_clock::now()};
+    lookup(keys[i]);
+    auto end{std::chrono::steady_clock::now()};
+    histogram.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+  }
+  return histogram;
 }
 
-void print_memory_stats(std::string_view label) noexcept {
-  auto alloc{allocations};
-  auto dealloc{deallocations};
-  auto asize{allocated};
-  auto dsize{deallocated};
-  auto max{maximum};
-  fmt::println("   @{}: Allocations: {}, Allocated: {}, Deallocations: {}, "
-               "Deallocated: {}, Maximum: {}",
-               label, alloc, asize, dealloc, dsize, max);
-  allocations = alloc;
-  deallocations = dealloc;
-  allocated = asize;
-  deallocated = dsize;
-  maximum = max;
+/*
+ * Returns the smallest interval between two consecutive clock readings,
+ * which is included in every latency sample
+ */
+inline uint64_t clock_overhead_ns() {
+  uint64_t best{UINT64_MAX};
+  for (int i = 0; i < 1000; ++i) {
+    auto start{std::chrono::steady_clock::now()};
+    auto end{std::chrono::steady_clock::now()};
+    best = std::min<uint64_t>(
+        best, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                  .count());
+  }
+  return best;
+}
+
+/*
+ * Creates an engine: weighted engines get the weight pattern repeated
+ * over the buckets
+ */
+template <typename Algorithm> Algorithm make_engine(const BenchOptions &o) {
+  if constexpr (requires(Algorithm &e) { e.setWeight(0u, 1u); }) {
+    Algorithm engine(o.anchor_set, o.working_set,
+                     o.weights.empty() ? 1
+                                       : *std::max_element(o.weights.begin(),
+                                                           o.weights.end()));
+    for (uint32_t i = 0; i < o.anchor_set && !o.weights.empty(); i++) {
+      engine.setWeight(i, o.weights[i % o.weights.size()]);
+    }
+    return engine;
+  } else {
+    return Algorithm(o.anchor_set, o.working_set);
+  }
 }
-#endif
 
 /*
  * ******************************************
@@ -103,14 +222,24 @@ void print_memory_stats(std::string_view label) noexcept {
  * ******************************************
  */
 template <typename Algorithm>
-int bench(const std::string_view name, const std::string &filename,
-          uint32_t anchor_set, uint32_t working_set, uint32_t num_removals,
-          uint32_t num_keys) {
+int bench(const std::string_view name, const BenchOptions &options) {
+  const auto &filename{options.filename};
+  const auto anchor_set{options.anchor_set};
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+  const auto num_keys{options.num_keys};
+  const auto replicas{options.replicas};
+  const auto &keys{options.keys};
+  const auto seed{options.seed};
+  const auto wall{options.wall};
 #ifdef USE_PCG32
-  pcg_extras::seed_seq_from<std::random_device> seed;
-  pcg32 rng{seed};
+  pcg_extras::seed_seq_from<std::random_device> random_seed;
+  pcg32 rng{random_seed};
+  if (seed) {
+    rng.seed(seed);
+  }
 #else
-  srand(time(NULL));
+  srand(seed ? seed : time(NULL));
 #endif
 
   std::ofstream results_file;
@@ -129,10 +258,11 @@ int bench(const std::string_view name, const std::string &filename,
   print_memory_stats("StartBenchmark");
 #endif
 
-  Algorithm engine(anchor_set, working_set);
+  auto engine{make_engine<Algorithm>(options)};
 
 #ifdef USE_HEAPSTATS
   print_memory_stats("AfterAlgorithmInit");
+  const auto init_heap{memory_stats().live};
 #endif
 
   uint32_t i = 0;
@@ -142,6 +272,10 @@ int bench(const std::string_view name, const std::string &filename,
 #else
     uint32_t removed = rand() % working_set;
 #endif
+    if (auto b = ordered_removal(options.removal_order, working_set, i);
+        b < working_set) {
+      removed = b;
+    }
     if (bucket_status[removed] == 1) {
       engine.removeBucket(removed);
       bucket_status[removed] = 0;
@@ -151,35 +285,170 @@ int bench(const std::string_view name, const std::string &filename,
 
 #ifdef USE_HEAPSTATS
   print_memory_stats("AfterRemovals");
+  /* The memory the engine needs to remember the removed buckets */
+  const auto removal_bytes{
+      num_removals ? static_cast<double>(memory_stats().live - init_heap) /
+                         num_removals
+                   : 0.0};
+  fmt::println("{} Heap per removed bucket is {} bytes", name, removal_bytes);
 #endif
 
+  std::optional<PerfCounters> counters;
+  if (options.perf) {
+    counters.emplace();
+  }
+
   volatile int64_t bucket{0};
+#ifdef USE_HOPSTATS
+  hopstats::reset();
+#endif
+  if (counters) {
+    counters->start();
+  }
+  Stopwatch watch;
   auto start{clock()};
-  for (uint32_t i = 0; i < num_keys; ++i) {
+  if (!keys.empty() && replicas <= 1) {
+    for (const auto &k : keys) {
+      bucket = engine.getBucketCRC32c(k.key, k.seed);
+    }
+  } else if (replicas > 1) {
+    if constexpr (requires(uint32_t *out) {
+                    engine.getReplicasCRC32c(0, 0, 1, out);
+                  }) {
+      std::vector<uint32_t> out(replicas);
+      if (!keys.empty()) {
+        for (const auto &k : keys) {
+          engine.getReplicasCRC32c(k.key, k.seed, replicas, out.data());
+          bucket = out[replicas - 1];
+        }
+      } else {
+        for (uint32_t i = 0; i < num_keys; ++i) {
+#ifdef USE_PCG32
+          engine.getReplicasCRC32c(rng(), rng(), replicas, out.data());
+#else
+          engine.getReplicasCRC32c(rand(), rand(), replicas, out.data());
+#endif
+          bucket = out[replicas - 1];
+        }
+      }
+    } else {
+      fmt::println("{} does not support replicas", name);
+      return 2;
+    }
+  } else {
+    for (uint32_t i = 0; i < num_keys; ++i) {
 #ifdef USE_PCG32
-    bucket = engine.getBucketCRC32c(rng(), rng());
+      bucket = engine.getBucketCRC32c(rng(), rng());
 #else
-    bucket = engine.getBucketCRC32c(rand(), rand());
+      bucket = engine.getBucketCRC32c(rand(), rand());
 #endif
+    }
   }
   auto end{clock()};
+  auto wall_elapsed{watch.seconds()};
+  if (counters) {
+    counters->stop();
+  }
 
 #ifdef USE_HEAPSTATS
   print_memory_stats("EndBenchmark");
 #endif
 
   auto elapsed{static_cast<double>(end - start) / CLOCKS_PER_SEC};
+  if (wall) {
+    /*
+     * Wall clock time of the lookups only: the time of a loop over the same
+     * keys without the engine is subtracted
+     */
+    auto baseline{empty_loop_seconds(keys)};
+    elapsed = std::max(wall_elapsed - baseline, 1e-9);
+    fmt::println("{} Wall time is {} seconds, empty loop baseline is {} "
+                 "seconds, CPU time is {} seconds",
+                 name, wall_elapsed, baseline,
+                 static_cast<double>(end - start) / CLOCKS_PER_SEC);
+  }
+#ifdef USE_HOPSTATS
+  /* Iterations of the lookup loops (the timing includes the counting) */
+  for (uint32_t l = 0; l < hopstats::LOOPS; ++l) {
+    auto hops{hopstats::summary(static_cast<hopstats::Loop>(l))};
+    if (hops.samples == 0) {
+      continue;
+    }
+    std::string histogram;
+    for (uint32_t n = 0; n < hopstats::BUCKETS; ++n) {
+      if (hops.counts[n]) {
+        histogram += fmt::format(" {}{}:{}", n,
+                                 n == hopstats::BUCKETS - 1 ? "+" : "",
+                                 hops.counts[n]);
+      }
+    }
+    fmt::println("{} Hops {} ({} removals, {}): {} samples, mean {}, p50 {}, "
+                 "p99 {}, p99.9 {}, max {}, histogram{}",
+                 name, hopstats::names[l], num_removals,
+                 options.removal_order, hops.samples, hops.mean(),
+                 hops.percentile(50), hops.percentile(99),
+                 hops.percentile(99.9), hops.max, histogram);
+  }
+#endif
+  if (counters) {
+    fmt::println("{} Per lookup{}: {}", name,
+                 keys.empty() ? " (including rand())" : "",
+                 counters->report(num_keys));
+  }
+  std::string latency_columns;
+  if (!options.latency_file.empty()) {
+    /*
+     * Latencies are sampled in a second pass, so that reading the clock
+     * does not affect the rate measured above
+     */
+    auto histogram{sample_latency(engine, keys, replicas,
+                                  std::max(options.latency_sample, 1u))};
+    auto ratio{100.0 * num_removals / working_set};
+    fmt::println("{} Latency at {}% removals (ns, {} samples, clock overhead "
+                 "{} ns): p50 {}, p99 {}, p99.9 {}, max {}, mean {}",
+                 name, ratio, histogram.count(), clock_overhead_ns(),
+                 histogram.percentile(50), histogram.percentile(99),
+                 histogram.percentile(99.9), histogram.max(),
+                 histogram.mean());
+    latency_columns = fmt::format("\tP50\t{}\tP99\t{}\tP999\t{}",
+                                  histogram.percentile(50),
+                                  histogram.percentile(99),
+                                  histogram.percentile(99.9));
+    std::ofstream latency_file;
+    latency_file.open(options.latency_file,
+                      std::ofstream::out | std::ofstream::app);
+    if (latency_file.tellp() == 0) {
+      latency_file << "algorithm,anchor,working,removals,removal_ratio,"
+                      "lower_ns,upper_ns,count,cumulative\n";
+    }
+    histogram.writeCsv(latency_file,
+                       fmt::format("{},{},{},{},{}", name, anchor_set,
+                                   working_set, num_removals, ratio / 100.0));
+  }
+  if constexpr (requires { engine.hits(); }) {
+    auto lookups{engine.hits() + engine.misses()};
+    fmt::println("{} Cache hit rate is {}% ({} hits out of {} lookups)", name,
+                 lookups ? 100.0 * engine.hits() / lookups : 0.0,
+                 engine.hits(), lookups);
+  }
 #ifdef USE_HEAPSTATS
-  auto maxheap{maximum};
-  fmt::println("{} Elapsed time is {} seconds, maximum heap allocated memory is {} bytes, sizeof({}) is {}", name, elapsed, maxheap, name, sizeof(Algorithm));
+  auto maxheap{memory_stats().peak};
+  auto peak_rss{heapstats::peakRss()};
+  fmt::println("{} Elapsed time is {} seconds, maximum heap allocated memory is {} bytes, peak RSS is {} bytes, sizeof({}) is {}", name, elapsed, maxheap, peak_rss, name, sizeof(Algorithm));
   results_file << name << ":\tAnchor\t" << anchor_set << "\tWorking\t"
                << working_set << "\tRemovals\t" << num_removals << "\tRate\t"
-               << norm_keys_rate / elapsed << "\tMaxHeap\t" << maxheap << "\tAlgoSizeof\t" << sizeof(Algorithm)<< "\n";
+               << norm_keys_rate / elapsed << "\tMaxHeap\t" << maxheap << "\tAlgoSizeof\t" << sizeof(Algorithm)
+               << "\tBytesPerRemoval\t" << removal_bytes << "\tPeakRss\t"
+               << peak_rss
+               << (replicas > 1 ? fmt::format("\tReplicas\t{}", replicas) : "")
+               << latency_columns << "\n";
 #else
   fmt::println("{} Elapsed time is {} seconds", name, elapsed);
   results_file << name << ":\tAnchor\t" << anchor_set << "\tWorking\t"
                << working_set << "\tRemovals\t" << num_removals << "\tRate\t"
-               << norm_keys_rate / elapsed << "\n";
+               << norm_keys_rate / elapsed
+               << (replicas > 1 ? fmt::format("\tReplicas\t{}", replicas) : "")
+               << latency_columns << "\n";
 #endif
 
 
@@ -191,11 +460,566 @@ int bench(const std::string_view name, const std::string &filename,
   return 0;
 }
 
+/*
+ * ******************************************
+ * Multithreaded scaling benchmark: for each thread count, every thread
+ * looks up its own stream of NumKeys keys against the same engine.
+ * Threads are pinned to distinct cores and start together.
+ * ******************************************
+ */
+template <typename Algorithm>
+int bench_threads(const std::string_view name, const BenchOptions &options) {
+  const auto anchor_set{options.anchor_set};
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+  const auto num_keys{options.num_keys};
+  const auto seed{options.seed};
+
+  if constexpr (!requires(const Algorithm &e) { e.getBucketCRC32c(0, 0); }) {
+    fmt::println("{} has no read-only lookup and cannot be shared between "
+                 "threads",
+                 name);
+    return 2;
+  } else {
+    srand(seed ? seed : time(NULL));
+
+    std::ofstream results_file;
+    results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+
+    std::vector<uint32_t> bucket_status(anchor_set);
+    for (uint32_t i = 0; i < working_set; i++) {
+      bucket_status[i] = 1;
+    }
+
+#ifdef USE_HEAPSTATS
+    reset_memory_stats();
+#endif
+    auto engine{make_engine<Algorithm>(options)};
+    uint32_t i = 0;
+    while (i < num_removals) {
+      uint32_t removed = rand() % working_set;
+      if (auto b = ordered_removal(options.removal_order, working_set, i);
+          b < working_set) {
+        removed = b;
+      }
+      if (bucket_status[removed] == 1) {
+        engine.removeBucket(removed);
+        bucket_status[removed] = 0;
+        i++;
+      }
+    }
+
+#ifdef USE_HEAPSTATS
+    const auto engine_heap{memory_stats().live};
+#endif
+    const Algorithm &shared{engine};
+    for (auto num_threads : options.threads) {
+      /* Every thread has its own stream of keys */
+      std::vector<std::vector<Key>> keys(num_threads);
+      for (uint32_t t = 0; t < num_threads; ++t) {
+        KeySource source{options.key_source, options.keyspace,
+                         seed ? seed + t : 0};
+        keys[t] = source.generate(num_keys);
+      }
+
+#ifdef USE_HEAPSTATS
+      /* Memory allocated by the threads during the lookups */
+      heapstats::resetPeak();
+      const auto lookup_start{heapstats::snapshot()};
+#endif
+      std::vector<double> elapsed(num_threads);
+      std::barrier start{num_threads};
+      std::vector<std::thread> workers;
+      for (uint32_t t = 0; t < num_threads; ++t) {
+        workers.emplace_back([&, t] {
+          pin_to_core(t);
+          volatile int64_t bucket{0};
+          start.arrive_and_wait();
+          Stopwatch watch;
+          for (const auto &k : keys[t]) {
+            bucket = shared.getBucketCRC32c(k.key, k.seed);
+          }
+          elapsed[t] = watch.seconds();
+        });
+      }
+      for (auto &w : workers) {
+        w.join();
+      }
+#ifdef USE_HEAPSTATS
+      const auto lookup_heap{heapstats::snapshot().peak - lookup_start.live};
+      const auto peak_rss{heapstats::peakRss()};
+      fmt::println("{} Threads: {}, engine heap is {} bytes, heap growth "
+                   "during the lookups is {} bytes, peak RSS is {} bytes",
+                   name, num_threads, engine_heap, lookup_heap, peak_rss);
+#endif
+
+      auto norm_keys_rate = (double)num_keys / 1000000.0;
+      auto slowest = *std::max_element(elapsed.begin(), elapsed.end());
+      auto aggregate = norm_keys_rate * num_threads / slowest;
+      std::string per_thread;
+      for (uint32_t t = 0; t < num_threads; ++t) {
+        per_thread += fmt::format("{}{:.3f}", t ? " " : "",
+                                  norm_keys_rate / elapsed[t]);
+      }
+      fmt::println("{} Threads: {}, aggregate rate is {} Mkeys/s ({} Mkeys/s "
+                   "per thread), per-thread rates: {}",
+                   name, num_threads, aggregate, aggregate / num_threads,
+                   per_thread);
+      results_file << name << ":\tAnchor\t" << anchor_set << "\tWorking\t"
+                   << working_set << "\tRemovals\t" << num_removals
+                   << "\tThreads\t" << num_threads << "\tRate\t" << aggregate
+                   << "\tThreadRates\t" << per_thread
+#ifdef USE_HEAPSTATS
+                   << "\tHeap\t" << engine_heap << "\tLookupHeap\t"
+                   << lookup_heap << "\tPeakRss\t" << peak_rss
+#endif
+                   << "\n";
+    }
+
+    results_file.close();
+    return 0;
+  }
+}
+
+/*
+ * ******************************************
+ * Dual-epoch benchmark routine: the new epoch has epoch_removals more random
+ * removals than the old one, and both owners of each key are computed with
+ * a DualEpochView and with two lookups.
+ * ******************************************
+ */
+template <typename Algorithm>
+int bench_dual(const std::string_view name, const BenchOptions &options) {
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+  const auto &keys{options.keys};
+
+  if constexpr (!requires(const Algorithm &e) { e.getBucketCRC32c(0, 0); }) {
+    fmt::println("{} has no read-only lookup and cannot have two epochs",
+                 name);
+    return 2;
+  } else {
+    srand(options.seed ? options.seed : time(NULL));
+
+    std::ofstream results_file;
+    results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+
+    auto old_epoch{make_engine<Algorithm>(options)};
+    auto new_epoch{make_engine<Algorithm>(options)};
+
+    std::vector<uint32_t> bucket_status(
+        std::max(options.anchor_set, working_set));
+    for (uint32_t i = 0; i < working_set; i++) {
+      bucket_status[i] = 1;
+    }
+    auto remove = [&](uint32_t i, bool both) {
+      for (;;) {
+        uint32_t removed = rand() % working_set;
+        if (auto b = ordered_removal(options.removal_order, working_set, i);
+            b < working_set) {
+          removed = b;
+        }
+        if (bucket_status[removed] == 1) {
+          auto b = new_epoch.removeBucket(removed);
+          if (both) {
+            old_epoch.removeBucket(removed);
+          }
+          bucket_status[b] = 0;
+          return;
+        }
+      }
+    };
+    for (uint32_t i = 0; i < num_removals; ++i) {
+      remove(i, true);
+    }
+    for (uint32_t i = 0; i < options.epoch_removals; ++i) {
+      remove(num_removals + i, false);
+    }
+
+    const DualEpochView<Algorithm> view{old_epoch, new_epoch};
+    volatile int64_t bucket{0};
+    uint64_t moved{0};
+    Stopwatch watch;
+    for (const auto &k : keys) {
+      auto [o, n] = view.getBucketPair(k.key, k.seed);
+      moved += o != n;
+    }
+    const auto pair_time = watch.seconds();
+    watch.restart();
+    for (const auto &k : keys) {
+      bucket = old_epoch.getBucketCRC32c(k.key, k.seed);
+      bucket = new_epoch.getBucketCRC32c(k.key, k.seed);
+    }
+    const auto two_time = watch.seconds();
+
+    for (const auto &k : keys) {
+      auto [o, n] = view.getBucketPair(k.key, k.seed);
+      if (o != old_epoch.getBucketCRC32c(k.key, k.seed) ||
+          n != new_epoch.getBucketCRC32c(k.key, k.seed)) {
+        fmt::println("{}: crazy bug!", name);
+        return 1;
+      }
+    }
+
+    auto norm_keys_rate = (double)keys.size() / 1000000.0;
+    fmt::println("{}: {} removals between the epochs, {}% keys moved, pair "
+                 "rate is {} Mkeys/s, two lookups rate is {} Mkeys/s",
+                 name, options.epoch_removals,
+                 100.0 * moved / std::max<size_t>(keys.size(), 1),
+                 norm_keys_rate / pair_time, norm_keys_rate / two_time);
+    results_file << name << ":\tAnchor\t" << options.anchor_set
+                 << "\tWorking\t" << working_set << "\tRemovals\t"
+                 << num_removals << "\tEpochRemovals\t"
+                 << options.epoch_removals << "\tPairRate\t"
+                 << norm_keys_rate / pair_time << "\tTwoLookupsRate\t"
+                 << norm_keys_rate / two_time << "\n";
+
+    results_file.close();
+    return 0;
+  }
+}
+
+/*
+ * The algorithms of the benchmark
+ */
+using Algorithms =
+    Engines::With<WeightedEngine<MementoEngine<boost::unordered_flat_map>>,
+                  WeightedEngine<AnchorEngine>,
+                  CachedEngine<MementoEngine<boost::unordered_flat_map>>,
+                  CachedEngine<AnchorEngine>>;
+
+/*
+ * ******************************************
+ * Batch benchmark routine: the same keys are looked up on the engine, on
+ * the engine selected at run time (Algorithms::Any) key by key, and on the
+ * engine selected at run time in batches of batch keys.
+ * ******************************************
+ */
+template <typename Algorithm>
+int bench_batch(const std::string_view name, const BenchOptions &options) {
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+  const auto batch{options.batch};
+
+  srand(options.seed ? options.seed : time(NULL));
+
+  std::ofstream results_file;
+  results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+
+  /* Engines selected at run time are created without weights */
+  Algorithm engine(options.anchor_set, working_set);
+  Algorithms::Any any{std::in_place_type<Algorithm>, options.anchor_set,
+                      working_set};
+
+  std::vector<uint32_t> bucket_status(std::max(options.anchor_set, working_set));
+  for (uint32_t i = 0; i < working_set; i++) {
+    bucket_status[i] = 1;
+  }
+  uint32_t i = 0;
+  while (i < num_removals) {
+    uint32_t removed = rand() % working_set;
+    if (auto b = ordered_removal(options.removal_order, working_set, i);
+        b < working_set) {
+      removed = b;
+    }
+    if (bucket_status[removed] == 1) {
+      engine.removeBucket(removed);
+      any.removeBucket(removed);
+      bucket_status[removed] = 0;
+      i++;
+    }
+  }
+
+  const auto n = options.keys.size();
+  std::vector<uint64_t> keys(n), seeds(n);
+  for (size_t k = 0; k < n; ++k) {
+    keys[k] = options.keys[k].key;
+    seeds[k] = options.keys[k].seed;
+  }
+  std::vector<uint32_t> direct(n), single(n), batched(n);
+
+  Stopwatch watch;
+  for (size_t k = 0; k < n; ++k) {
+    direct[k] = engine.getBucketCRC32c(keys[k], seeds[k]);
+  }
+  const auto direct_time = watch.seconds();
+  watch.restart();
+  for (size_t k = 0; k < n; ++k) {
+    single[k] = any.getBucketCRC32c(keys[k], seeds[k]);
+  }
+  const auto single_time = watch.seconds();
+  watch.restart();
+  for (size_t k = 0; k < n; k += batch) {
+    any.getBucketsCRC32c(&keys[k], &seeds[k], std::min<size_t>(batch, n - k),
+                         &batched[k]);
+  }
+  const auto batch_time = watch.seconds();
+  /*
+   * The share of the hashing in the lookups, and the lookups on the engine
+   * from these hashes (if it can resolve a key from its hash)
+   */
+  std::vector<uint32_t> hashes(n), staged(n);
+  watch.restart();
+  crc32cBatch(keys.data(), seeds.data(), n, hashes.data());
+  const auto hash_time = watch.seconds();
+  constexpr bool from_hash{requires(const Algorithm &e) {
+    e.getBucketFromHash(0, 0, 0u);
+  }};
+  watch.restart();
+  if constexpr (from_hash) {
+    for (size_t k = 0; k < n; ++k) {
+      staged[k] = engine.getBucketFromHash(keys[k], seeds[k], hashes[k]);
+    }
+  } else {
+    staged = direct;
+  }
+  const auto staged_time = hash_time + watch.seconds();
+
+  if (direct != single || direct != batched || direct != staged) {
+    fmt::println("{}: crazy bug!", name);
+    return 1;
+  }
+
+  auto norm_keys_rate = (double)n / 1000000.0;
+  fmt::println("{}: engine rate is {} Mkeys/s, selected at run time {} "
+               "Mkeys/s, in batches of {} {} Mkeys/s (hashing only {} "
+               "Mkeys/s)",
+               name, norm_keys_rate / direct_time, norm_keys_rate / single_time,
+               batch, norm_keys_rate / batch_time, norm_keys_rate / hash_time);
+  if constexpr (from_hash) {
+    fmt::println("{}: hashing first with crc32cBatch, then looking up from "
+                 "the hashes {} Mkeys/s",
+                 name, norm_keys_rate / staged_time);
+  }
+  results_file << name << ":\tAnchor\t" << options.anchor_set << "\tWorking\t"
+               << working_set << "\tRemovals\t" << num_removals
+               << "\tBatch\t" << batch << "\tEngineRate\t"
+               << norm_keys_rate / direct_time << "\tAnyRate\t"
+               << norm_keys_rate / single_time << "\tAnyBatchRate\t"
+               << norm_keys_rate / batch_time << "\tHashRate\t"
+               << norm_keys_rate / hash_time << "\tStagedRate\t"
+               << (from_hash ? norm_keys_rate / staged_time : 0.0) << "\n";
+
+  results_file.close();
+  return 0;
+}
+
+/*
+ * ******************************************
+ * Node benchmark routine: keys are resolved to a node record through a
+ * bucket->node hash map, through a NodeTableEngine, and through a
+ * NodeTableEngine in batches with prefetching.
+ * ******************************************
+ */
+template <typename Algorithm>
+int bench_nodes(const std::string_view name, const BenchOptions &options) {
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+
+  if constexpr (!requires(const Algorithm &e) { e.getBucketCRC32c(0, 0); }) {
+    fmt::println("{} has no read-only lookup", name);
+    return 2;
+  } else {
+    /* A server handle */
+    struct Node final {
+      uint64_t address;
+      uint32_t port;
+      uint32_t id;
+    };
+
+    srand(options.seed ? options.seed : time(NULL));
+
+    std::ofstream results_file;
+    results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+
+    NodeTableEngine<Algorithm, Node> engine(options.anchor_set, working_set);
+    std::unordered_map<uint32_t, Node> nodes;
+    for (uint32_t i = 0; i < working_set; i++) {
+      Node node{0x0A000000ULL + i, 11211, i};
+      engine.setNode(i, node);
+      nodes.emplace(i, node);
+    }
+
+    std::vector<uint32_t> bucket_status(
+        std::max(options.anchor_set, working_set));
+    for (uint32_t i = 0; i < working_set; i++) {
+      bucket_status[i] = 1;
+    }
+    uint32_t i = 0;
+    while (i < num_removals) {
+      uint32_t removed = rand() % working_set;
+      if (auto b = ordered_removal(options.removal_order, working_set, i);
+          b < working_set) {
+        removed = b;
+      }
+      if (bucket_status[removed] == 1) {
+        auto b = engine.removeBucket(removed);
+        nodes.erase(b);
+        bucket_status[b] = 0;
+        i++;
+      }
+    }
+
+    const auto n = options.keys.size();
+    std::vector<uint64_t> keys(n), seeds(n);
+    for (size_t k = 0; k < n; ++k) {
+      keys[k] = options.keys[k].key;
+      seeds[k] = options.keys[k].seed;
+    }
+    std::vector<const Node *> batched(n);
+    uint64_t map_sum{0}, table_sum{0}, batch_sum{0};
+
+    Stopwatch watch;
+    for (size_t k = 0; k < n; ++k) {
+      map_sum += nodes.find(engine.getBucketCRC32c(keys[k], seeds[k]))
+                     ->second.id;
+    }
+    const auto map_time = watch.seconds();
+    watch.restart();
+    for (size_t k = 0; k < n; ++k) {
+      table_sum += engine.getNodeCRC32c(keys[k], seeds[k]).id;
+    }
+    const auto table_time = watch.seconds();
+    watch.restart();
+    engine.getNodesCRC32c(keys.data(), seeds.data(), n, batched.data());
+    for (size_t k = 0; k < n; ++k) {
+      batch_sum += batched[k]->id;
+    }
+    const auto batch_time = watch.seconds();
+
+    if (map_sum != table_sum || map_sum != batch_sum) {
+      fmt::println("{}: crazy bug!", name);
+      return 1;
+    }
+
+    auto norm_keys_rate = (double)n / 1000000.0;
+    fmt::println("{}: node through a hash map {} Mkeys/s, through the node "
+                 "table {} Mkeys/s, in batches with prefetching {} Mkeys/s",
+                 name, norm_keys_rate / map_time, norm_keys_rate / table_time,
+                 norm_keys_rate / batch_time);
+    results_file << name << ":\tAnchor\t" << options.anchor_set
+                 << "\tWorking\t" << working_set << "\tRemovals\t"
+                 << num_removals << "\tMapRate\t" << norm_keys_rate / map_time
+                 << "\tTableRate\t" << norm_keys_rate / table_time
+                 << "\tTableBatchRate\t" << norm_keys_rate / batch_time
+                 << "\n";
+
+    results_file.close();
+    return 0;
+  }
+}
+
+/*
+ * ******************************************
+ * String key benchmark routine: keys of key_bytes bytes (generated from
+ * the pre-generated keys) are looked up with getBucket(std::string_view).
+ * ******************************************
+ */
+template <typename Algorithm>
+int bench_strings(const std::string_view name, const BenchOptions &options) {
+  const auto working_set{options.working_set};
+  const auto num_removals{options.num_removals};
+  const auto key_bytes{options.key_bytes};
+
+  if constexpr (!requires(const Algorithm &e, std::string_view k) {
+                  e.getBucket(k);
+                }) {
+    fmt::println("{} has no lookup for string keys", name);
+    return 2;
+  } else {
+    srand(options.seed ? options.seed : time(NULL));
+
+    std::ofstream results_file;
+    results_file.open(options.filename, std::ofstream::out | std::ofstream::app);
+
+    Algorithm engine(options.anchor_set, working_set);
+    std::vector<uint32_t> bucket_status(
+        std::max(options.anchor_set, working_set));
+    for (uint32_t i = 0; i < working_set; i++) {
+      bucket_status[i] = 1;
+    }
+    uint32_t i = 0;
+    while (i < num_removals) {
+      uint32_t removed = rand() % working_set;
+      if (auto b = ordered_removal(options.removal_order, working_set, i);
+          b < working_set) {
+        removed = b;
+      }
+      if (bucket_status[removed] == 1) {
+        engine.removeBucket(removed);
+        bucket_status[removed] = 0;
+        i++;
+      }
+    }
+
+    /* The bytes of each key are a SplitMix64 stream seeded by the key */
+    const auto n = options.keys.size();
+    std::vector<char> bytes(n * key_bytes);
+    for (size_t k = 0; k < n; ++k) {
+      uint64_t state = (uint64_t{options.keys[k].key} << 32) |
+                       options.keys[k].seed;
+      for (uint32_t j = 0; j < key_bytes; j += sizeof(uint64_t)) {
+        auto z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        std::memcpy(&bytes[k * key_bytes + j], &z,
+                    std::min<size_t>(sizeof z, key_bytes - j));
+      }
+    }
+
+    volatile int64_t bucket{0};
+    Stopwatch watch;
+    for (size_t k = 0; k < n; ++k) {
+      bucket = engine.getBucket(
+          std::string_view{&bytes[k * key_bytes], key_bytes});
+    }
+    const auto elapsed = watch.seconds();
+
+    auto norm_keys_rate = (double)n / 1000000.0;
+    fmt::println("{}: {} bytes keys rate is {} Mkeys/s ({} removals)", name,
+                 key_bytes, norm_keys_rate / elapsed, num_removals);
+    results_file << name << ":\tAnchor\t" << options.anchor_set
+                 << "\tWorking\t" << working_set << "\tRemovals\t"
+                 << num_removals << "\tKeyBytes\t" << key_bytes
+                 << "\tRate\t" << norm_keys_rate / elapsed << "\n";
+
+    results_file.close();
+    return 0;
+  }
+}
+
+/*
+ * Runs the benchmark or, with thread counts, the scaling benchmark or,
+ * with epoch removals, the dual-epoch benchmark or, with a batch size, the
+ * batch benchmark or, with nodes, the node benchmark or, with a key
+ * length, the string key benchmark
+ */
+template <typename Algorithm>
+int run(const std::string_view name, const BenchOptions &options) {
+  if (!options.threads.empty()) {
+    return bench_threads<Algorithm>(name, options);
+  }
+  if (options.epoch_removals) {
+    return bench_dual<Algorithm>(name, options);
+  }
+  if (options.batch) {
+    return bench_batch<Algorithm>(name, options);
+  }
+  if (options.nodes) {
+    return bench_nodes<Algorithm>(name, options);
+  }
+  if (options.key_bytes) {
+    return bench_strings<Algorithm>(name, options);
+  }
+  return bench<Algorithm>(name, options);
+}
+
 int main(int argc, char *argv[]) {
   cxxopts::Options options("speed_test", "MementoHash vs AnchorHash benchmark");
   options.add_options()(
       "Algorithm",
-      "Algorithm (null|baseline|anchor|memento|mementoboost|mementomash|mementostd|mementogtl|jump|power)",
+      "Algorithm (null|baseline|" + Algorithms::names() + ")",
       cxxopts::value<std::string>())(
       "AnchorSet", "Size of the AnchorSet (ignored by Memento)",
       cxxopts::value<int>())("WorkingSet", "Size of the WorkingSet",
@@ -203,13 +1027,65 @@ int main(int argc, char *argv[]) {
       "NumRemovals", "Number of random removals", cxxopts::value<int>())(
       "NumKeys", "Number of keys to lookup for",
       cxxopts::value<int>())("ResFileName", "Number of keys to lookup for",
-                             cxxopts::value<std::string>());
+                             cxxopts::value<std::string>())(
+      "weights",
+      "Comma separated bucket weights, repeated over the buckets "
+      "(weighted algorithms only)",
+      cxxopts::value<std::string>()->default_value(""))(
+      "replicas", "Number of distinct buckets to lookup for each key",
+      cxxopts::value<int>()->default_value("1"))(
+      "keys",
+      "Key source (rand|uniform|zipf:S|hotspot:F:P|sequential), keys other "
+      "than rand are generated before the timed loop",
+      cxxopts::value<std::string>()->default_value("rand"))(
+      "keyspace", "Number of distinct keys (zipf and hotspot)",
+      cxxopts::value<int>()->default_value("1000000"))(
+      "seed", "Seed for keys and removals (0 means random)",
+      cxxopts::value<uint64_t>()->default_value("0"))(
+      "timing",
+      "Timing mode (cpu|wall): cpu measures the CPU time of the loop with "
+      "clock(), wall pre-generates the keys, uses a steady wall clock and "
+      "subtracts the empty loop time",
+      cxxopts::value<std::string>()->default_value("cpu"))(
+      "threads",
+      "Comma separated thread counts: runs NumKeys lookups per thread "
+      "against a shared engine for each thread count",
+      cxxopts::value<std::string>()->default_value(""))(
+      "latency",
+      "CSV file receiving the latency histogram: lookups are timed one by "
+      "one in a second pass and percentiles are printed",
+      cxxopts::value<std::string>()->default_value(""))(
+      "latency-sample", "Time one lookup every N lookups",
+      cxxopts::value<int>()->default_value("1"))(
+      "perf",
+      "Read hardware performance counters (cycles, instructions, cache, "
+      "TLB and branch misses) around the lookups and report them per lookup",
+      cxxopts::value<bool>()->default_value("false"))(
+      "removal-order",
+      "Order of the removals (random|ascending|descending), descending "
+      "removes the last buckets first",
+      cxxopts::value<std::string>()->default_value("random"))(
+      "dual-epoch",
+      "Compute the owners of each key in two epochs, the new one with N "
+      "more removals, in a single pass and with two lookups",
+      cxxopts::value<int>()->default_value("0"))(
+      "batch",
+      "Compare lookups on the engine with lookups on the engine selected at "
+      "run time, key by key and in batches of N keys",
+      cxxopts::value<int>()->default_value("0"))(
+      "nodes",
+      "Compare resolving keys to node records through a hash map and "
+      "through a node table",
+      cxxopts::value<bool>()->default_value("false"))(
+      "key-bytes",
+      "Look up string keys of N bytes with getBucket (Memento only)",
+      cxxopts::value<int>()->default_value("0"));
   options.positional_help(
       "Algorithm AnchorSet WorkingSet NumRemovals Numkeys ResFilename");
   options.parse_positional({"Algorithm", "AnchorSet", "WorkingSet",
                             "NumRemovals", "NumKeys", "ResFileName"});
   auto result = options.parse(argc, argv);
-  if (argc != 7) {
+  if (!result.count("ResFileName")) {
     fmt::println("{}", options.help());
     exit(1);
   }
@@ -220,6 +1096,27 @@ int main(int argc, char *argv[]) {
   auto num_removals = static_cast<uint32_t>(result["NumRemovals"].as<int>());
   auto num_keys = static_cast<uint32_t>(result["NumKeys"].as<int>());
   auto filename = result["ResFileName"].as<std::string>();
+  auto weights = parsePositiveList(result["weights"].as<std::string>());
+  auto replicas = static_cast<uint32_t>(result["replicas"].as<int>());
+  auto key_source = result["keys"].as<std::string>();
+  auto keyspace = static_cast<uint32_t>(result["keyspace"].as<int>());
+  auto seed = result["seed"].as<uint64_t>();
+  auto wall = result["timing"].as<std::string>() == "wall";
+  auto threads = parsePositiveList(result["threads"].as<std::string>());
+  auto latency_file = result["latency"].as<std::string>();
+  auto latency_sample =
+      static_cast<uint32_t>(result["latency-sample"].as<int>());
+  auto perf = result["perf"].as<bool>();
+  auto removal_order = result["removal-order"].as<std::string>();
+  auto epoch_removals = static_cast<uint32_t>(result["dual-epoch"].as<int>());
+  auto batch = static_cast<uint32_t>(result["batch"].as<int>());
+  auto nodes = result["nodes"].as<bool>();
+  auto key_bytes = static_cast<uint32_t>(result["key-bytes"].as<int>());
+  if ((wall || !threads.empty() || !latency_file.empty() || epoch_removals ||
+       batch || nodes || key_bytes) &&
+      key_source == "rand") {
+    key_source = "uniform";
+  }
 
 #ifdef USE_PCG32
   fmt::println("Algorithm: {}, AnchorSet: {}, WorkingSet: {}, NumRemovals: {}, "
@@ -233,6 +1130,36 @@ int main(int argc, char *argv[]) {
                filename);
 #endif
 
+  BenchOptions bench_options{.filename = filename,
+                             .anchor_set = anchor_set,
+                             .working_set = working_set,
+                             .num_removals = num_removals,
+                             .num_keys = num_keys,
+                             .weights = weights,
+                             .replicas = replicas,
+                             .keys = {},
+                             .key_source = key_source,
+                             .keyspace = keyspace,
+                             .seed = seed,
+                             .wall = wall,
+                             .threads = threads,
+                             .latency_file = latency_file,
+                             .latency_sample = latency_sample,
+                             .perf = perf,
+                             .removal_order = removal_order,
+                             .epoch_removals = epoch_removals,
+                             .batch = batch,
+                             .nodes = nodes,
+                             .key_bytes = key_bytes};
+
+  /* Keys other than rand() are generated before the benchmark */
+  if (key_source != "rand" && threads.empty()) {
+    KeySource source{key_source, keyspace, seed};
+    bench_options.keys = source.generate(num_keys);
+    fmt::println("Keys: {}, KeySpace: {}, Seed: {}", key_source, keyspace,
+                 source.seed());
+  }
+
   if (algorithm == "null") {
     // do nothing
   } else if (algorithm == "baseline") {
@@ -261,39 +1188,10 @@ int main(int argc, char *argv[]) {
       }
     }
     delete[] bucket_status;
-  } else if (algorithm == "anchor") {
-    return bench<AnchorEngine>("Anchor", filename, anchor_set, working_set,
-                               num_removals, num_keys);
-  } else if (algorithm == "memento") {
-    return bench<MementoEngine<boost::unordered_flat_map>>(
-        "Memento<boost::unordered_flat_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementoboost") {
-    return bench<MementoEngine<boost::unordered_map>>(
-        "Memento<boost::unordered_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementostd") {
-    return bench<MementoEngine<std::unordered_map>>(
-        "Memento<std::unordered_map>", filename, anchor_set, working_set,
-        num_removals, num_keys);
-  } else if (algorithm == "mementogtl") {
-      return bench<MementoEngine<gtl::flat_hash_map>>(
-          "Memento<std::gtl::flat_hash_map>", filename, anchor_set, working_set,
-          num_removals, num_keys);
-  } else if (algorithm == "mementomash") {
-    return bench<MementoEngine<MashTable>>("Memento<MashTable>", filename,
-                                           anchor_set, working_set,
-                                           num_removals, num_keys);
-  } else if (algorithm == "jump") {
-      return bench<JumpEngine>("JumpEngine", filename,
-                                             anchor_set, working_set,
-                                             num_removals, num_keys);
-  } else if (algorithm == "power") {
-      return bench<PowerEngine>("PowerEngine", filename,
-                               anchor_set, working_set,
-                               num_removals, num_keys);
   } else {
-    fmt::println("Unknown algorithm {}", algorithm);
-    return 2;
+    return Algorithms::dispatch(
+        algorithm, [&]<typename Algorithm>(const std::string &name) {
+          return run<Algorithm>(name, bench_options);
+        });
   }
 }
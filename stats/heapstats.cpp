@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "heapstats.h"
+
+/*
+ * Replacements of every form of operator new and delete, counted by the
+ * thread that calls them (see heapstats.h). Without USE_HEAPSTATS this
+ * file is empty and the default operators are used.
+ */
+#ifdef USE_HEAPSTATS
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+
+namespace {
+
+void *allocate(size_t size) noexcept {
+  void *p = std::malloc(size ? size : 1);
+  if (p) {
+    heapstats::allocation(size, malloc_usable_size(p));
+  }
+  return p;
+}
+
+void *allocate(size_t size, std::align_val_t alignment) noexcept {
+  const auto align = std::max(static_cast<size_t>(alignment), sizeof(void *));
+  void *p{nullptr};
+  if (posix_memalign(&p, align, size ? size : 1) != 0) {
+    return nullptr;
+  }
+  heapstats::allocation(size, malloc_usable_size(p));
+  return p;
+}
+
+void release(void *ptr) noexcept {
+  if (ptr) {
+    heapstats::deallocation(malloc_usable_size(ptr));
+    std::free(ptr);
+  }
+}
+
+template <typename... Alignment>
+void *allocateOrThrow(size_t size, Alignment... alignment) {
+  while (true) {
+    if (void *p = allocate(size, alignment...)) {
+      return p;
+    }
+    auto handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc{};
+    }
+    handler();
+  }
+}
+
+} // namespace
+
+void *operator new(size_t size) { return allocateOrThrow(size); }
+
+void *operator new[](size_t size) { return allocateOrThrow(size); }
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  return allocateOrThrow(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return allocateOrThrow(size, alignment);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept { release(ptr); }
+
+void operator delete[](void *ptr) noexcept { release(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { release(ptr); }
+
+void operator delete[](void *ptr, size_t) noexcept { release(ptr); }
+
+void operator delete(void *ptr, std::align_val_t) noexcept { release(ptr); }
+
+void operator delete[](void *ptr, std::align_val_t) noexcept { release(ptr); }
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  release(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  release(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HEAPSTATS_H
+#define HEAPSTATS_H
+
+/*
+ * Heap accounting of the benchmarks, enabled at compile time with
+ * USE_HEAPSTATS (CMake option WITH_HEAPSTATS). Every form of operator
+ * new and delete (plain, array, nothrow, sized and aligned) is replaced in
+ * stats/heapstats.cpp, which must be linked into the driver.
+ *
+ * Each thread counts its allocations in its own cache line, without atomic
+ * read-modify-write operations; the counters of all the threads are summed
+ * on demand (snapshot). Bytes are counted with malloc_usable_size, so that
+ * a block is freed with the same size it was allocated with whatever the
+ * form of delete, and from any thread.
+ *
+ *   auto before{heapstats::snapshot()};
+ *   ...
+ *   auto used{heapstats::snapshot().live - before.live};
+ */
+#ifdef USE_HEAPSTATS
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace heapstats {
+
+/**
+ * The heap counters of a thread. Only the owner thread writes them, so they
+ * are updated with a relaxed load and store; other threads read them.
+ */
+struct alignas(64) Counters final {
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> deallocations{0};
+  /* Bytes requested from operator new */
+  std::atomic<uint64_t> requested{0};
+  /* Usable bytes of the blocks allocated and freed by the thread */
+  std::atomic<uint64_t> allocated{0};
+  std::atomic<uint64_t> freed{0};
+  /* The largest value of allocated - freed since the last resetPeak */
+  std::atomic<int64_t> peak{0};
+};
+
+/*
+ * Threads beyond MAX_THREADS - 1 share the last counters, which are always
+ * updated with atomic read-modify-write operations
+ */
+inline constexpr uint32_t MAX_THREADS = 256;
+
+inline Counters counters[MAX_THREADS];
+inline std::atomic<uint32_t> threads{0};
+/*
+ * Constant initialized, so that no code runs on the first access of a
+ * thread (which happens within operator new)
+ */
+inline thread_local Counters *local{nullptr};
+
+/**
+ * Returns the counters of the calling thread, assigned on first use.
+ *
+ * @return the counters of the thread
+ */
+inline Counters &mine() noexcept {
+  if (!local) {
+    auto t = threads.fetch_add(1, std::memory_order_relaxed);
+    local = &counters[std::min(t, MAX_THREADS - 1)];
+  }
+  return *local;
+}
+
+/* Usable bytes allocated and not freed by the thread (may be negative) */
+inline int64_t live(const Counters &c) noexcept {
+  return static_cast<int64_t>(c.allocated.load(std::memory_order_relaxed) -
+                              c.freed.load(std::memory_order_relaxed));
+}
+
+inline void add(Counters &c, std::atomic<uint64_t> &counter,
+                uint64_t n) noexcept {
+  if (&c == &counters[MAX_THREADS - 1]) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  } else {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Counts an allocation of the calling thread.
+ *
+ * @param size the requested size
+ * @param usable the usable size of the block
+ */
+inline void allocation(size_t size, size_t usable) noexcept {
+  auto &c = mine();
+  add(c, c.allocations, 1);
+  add(c, c.requested, size);
+  add(c, c.allocated, usable);
+  const auto bytes = live(c);
+  if (bytes > c.peak.load(std::memory_order_relaxed)) {
+    c.peak.store(bytes, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Counts a deallocation of the calling thread.
+ *
+ * @param usable the usable size of the block
+ */
+inline void deallocation(size_t usable) noexcept {
+  auto &c = mine();
+  add(c, c.deallocations, 1);
+  add(c, c.freed, usable);
+}
+
+/**
+ * The heap counters of all the threads
+ */
+struct Snapshot final {
+  uint64_t allocations{0};
+  uint64_t deallocations{0};
+  /* Bytes requested from operator new */
+  uint64_t requested{0};
+  /* Usable bytes currently allocated */
+  int64_t live{0};
+  /*
+   * The largest live heap since the last resetPeak: exact when a single
+   * thread allocates, otherwise the sum of the peaks of the threads (an
+   * upper bound)
+   */
+  int64_t peak{0};
+};
+
+/**
+ * Sums the counters of all the threads.
+ *
+ * @return the counters
+ */
+inline Snapshot snapshot() noexcept {
+  Snapshot s;
+  const auto n =
+      std::min(threads.load(std::memory_order_relaxed), MAX_THREADS);
+  for (uint32_t t = 0; t < n; ++t) {
+    const auto &c = counters[t];
+    s.allocations += c.allocations.load(std::memory_order_relaxed);
+    s.deallocations += c.deallocations.load(std::memory_order_relaxed);
+    s.requested += c.requested.load(std::memory_order_relaxed);
+    s.live += live(c);
+    s.peak += c.peak.load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+/**
+ * Starts a new measurement of the peak: the peak of every thread is set to
+ * its current live heap. To be called while the other threads do not
+ * allocate.
+ */
+inline void resetPeak() noexcept {
+  const auto n =
+      std::min(threads.load(std::memory_order_relaxed), MAX_THREADS);
+  for (uint32_t t = 0; t < n; ++t) {
+    counters[t].peak.store(live(counters[t]), std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Returns the peak resident set size of the process (including the keys,
+ * the stacks and the memory not obtained with operator new).
+ *
+ * @return the peak RSS in bytes
+ */
+inline uint64_t peakRss() noexcept {
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  /* Kilobytes on Linux */
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+/**
+ * Returns the current resident set size of the process.
+ *
+ * @return the RSS in bytes, 0 if unknown
+ */
+inline uint64_t rss() noexcept {
+  unsigned long size{0}, resident{0};
+  auto *statm = std::fopen("/proc/self/statm", "r");
+  if (!statm) {
+    return 0;
+  }
+  if (std::fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  std::fclose(statm);
+  return static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+} // namespace heapstats
+#endif
+
+#endif // HEAPSTATS_H
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HOPSTATS_H
+#define HOPSTATS_H
+
+/*
+ * Iteration counts of the lookup loops, enabled at compile time with
+ * USE_HOPSTATS (CMake option WITH_HOPSTATS). When disabled the macros
+ * expand to nothing and the engines are unchanged.
+ *
+ *   HOPSTATS_DECLARE(hops);            declares a local counter
+ *   HOPSTATS_INCREMENT(hops);          counts one iteration
+ *   HOPSTATS_RECORD(MementoOuter, hops); adds the count to the histogram
+ */
+#ifdef USE_HOPSTATS
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace hopstats {
+
+/**
+ * The instrumented loops
+ */
+enum Loop : uint32_t {
+  /* Re-hashes after hitting a removed bucket (MementoEngine) */
+  MementoOuter,
+  /* Replacements followed within the re-hashes (MementoEngine) */
+  MementoInner,
+  /* Re-hashes until a working bucket (AnchorHashQre::ComputeBucket) */
+  AnchorBucket,
+  /* Steps of AnchorHashQre::ComputeTranslation */
+  AnchorTranslation,
+  /* Jumps of JumpEngine */
+  Jump,
+  /* Iterations of Algorithm-g (PowerEngine) */
+  PowerG,
+  LOOPS
+};
+
+inline constexpr const char *names[LOOPS] = {
+    "MementoOuter", "MementoInner", "AnchorBucket",
+    "AnchorTranslation", "Jump", "PowerG"};
+
+/* Iteration counts above BUCKETS-1 share the last bucket */
+inline constexpr uint32_t BUCKETS = 64;
+
+/**
+ * A copy of the histogram of a loop
+ */
+struct Summary final {
+  std::array<uint64_t, BUCKETS> counts{};
+  uint64_t samples{0};
+  uint64_t sum{0};
+  uint64_t max{0};
+
+  /**
+   * Returns the average number of iterations.
+   *
+   * @return the mean
+   */
+  double mean() const noexcept {
+    return samples ? static_cast<double>(sum) / samples : 0.0;
+  }
+
+  /**
+   * Returns the number of iterations below which the given percentage of
+   * the samples fall (BUCKETS-1 means at least BUCKETS-1).
+   *
+   * @param p the percentile in [0,100]
+   * @return the number of iterations
+   */
+  uint64_t percentile(double p) const noexcept {
+    const auto rank = static_cast<uint64_t>(p / 100.0 * samples);
+    uint64_t seen{0};
+    for (uint32_t i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen > rank || seen == samples) {
+        return i;
+      }
+    }
+    return BUCKETS - 1;
+  }
+};
+
+struct alignas(64) Histogram final {
+  std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+};
+
+inline Histogram histograms[LOOPS];
+
+/**
+ * Records the number of iterations of one execution of a loop.
+ * Counters are atomic, so concurrent lookups can be recorded.
+ *
+ * @param loop the loop
+ * @param iterations the number of iterations
+ */
+inline void record(Loop loop, uint64_t iterations) noexcept {
+  auto &h = histograms[loop];
+  h.counts[iterations < BUCKETS ? iterations : BUCKETS - 1].fetch_add(
+      1, std::memory_order_relaxed);
+  h.sum.fetch_add(iterations, std::memory_order_relaxed);
+  auto max = h.max.load(std::memory_order_relaxed);
+  while (iterations > max &&
+         !h.max.compare_exchange_weak(max, iterations,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+/**
+ * Clears every histogram.
+ */
+inline void reset() noexcept {
+  for (auto &h : histograms) {
+    for (auto &c : h.counts) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    h.sum.store(0, std::memory_order_relaxed);
+    h.max.store(0, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Returns a copy of the histogram of a loop.
+ *
+ * @param loop the loop
+ * @return the histogram
+ */
+inline Summary summary(Loop loop) noexcept {
+  const auto &h = histograms[loop];
+  Summary s;
+  for (uint32_t i = 0; i < BUCKETS; ++i) {
+    s.counts[i] = h.counts[i].load(std::memory_order_relaxed);
+    s.samples += s.counts[i];
+  }
+  s.sum = h.sum.load(std::memory_order_relaxed);
+  s.max = h.max.load(std::memory_order_relaxed);
+  return s;
+}
+
+} // namespace hopstats
+
+#define HOPSTATS_DECLARE(counter) uint64_t counter{0}
+#define HOPSTATS_INCREMENT(counter) (++(counter))
+#define HOPSTATS_RECORD(loop, counter)                                         \
+  hopstats::record(hopstats::loop, counter)
+#else
+#define HOPSTATS_DECLARE(counter)
+#define HOPSTATS_INCREMENT(counter) ((void)0)
+#define HOPSTATS_RECORD(loop, counter) ((void)0)
+#endif
+
+#endif // HOPSTATS_H
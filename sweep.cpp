@@ -0,0 +1,451 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench/affinity.h"
+#include "bench/keysource.h"
+#include "bench/lists.h"
+#include "bench/registry.h"
+#include "bench/statistics.h"
+#include "bench/timing.h"
+#include "stats/heapstats.h"
+#include <algorithm>
+#include <cmath>
+#include <cxxopts.hpp>
+#include <fmt/core.h>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+using Algorithms = Engines;
+
+/*
+ * ******************************************
+ * Parameter sweep: every algorithm x size x removal ratio is measured in
+ * this process, with warmup runs and repetitions, and summarized by the
+ * median rate and its 95% confidence interval
+ * ******************************************
+ */
+
+struct SweepOptions final {
+  /* Keys of the algorithms */
+  std::vector<std::string> algorithms;
+  /* Sizes of the working set (and of the anchor set) */
+  std::vector<uint32_t> sizes;
+  /* Fractions of the working set removed before the lookups */
+  std::vector<double> ratios;
+  uint32_t num_keys;
+  /* Unmeasured runs of the lookup loop before the repetitions */
+  uint32_t warmup;
+  uint32_t repetitions;
+  /* The core the sweep runs on (negative to leave the thread unpinned) */
+  int core;
+  std::string key_source;
+  uint32_t keyspace;
+  uint64_t seed;
+  std::string json;
+  std::string csv;
+};
+
+/*
+ * The measurements of one point of the sweep
+ */
+struct Point final {
+  std::string algorithm;
+  std::string name;
+  uint32_t size{0};
+  uint32_t removals{0};
+  double ratio{0};
+  uint32_t num_keys{0};
+  /* Rate of each repetition (Mkeys/s) */
+  std::vector<double> rates;
+  SampleSummary summary;
+  /* Heap of the engine per removed bucket (with heap statistics) */
+  double removal_bytes{0};
+};
+
+/*
+ * Measures one point: the engine is created and its buckets are removed
+ * once, then the lookup loop over the same keys runs warmup times and
+ * repetitions times.
+ */
+template <typename Algorithm>
+Point measure(const std::string &algorithm, const std::string &name,
+              uint32_t size, double ratio, const std::vector<Key> &keys,
+              const SweepOptions &options) {
+  Point point{.algorithm = algorithm,
+              .name = name,
+              .size = size,
+              .removals = static_cast<uint32_t>(
+                  std::min<double>(std::llround(ratio * size), size - 1)),
+              .ratio = ratio,
+              .num_keys = static_cast<uint32_t>(keys.size()),
+              .rates = {},
+              .summary = {},
+              .removal_bytes = 0};
+
+  /* The same removals for every algorithm */
+  std::mt19937_64 rng{options.seed + size};
+  std::vector<uint8_t> working(size, 1);
+
+  Algorithm engine(size, size);
+#ifdef USE_HEAPSTATS
+  const auto heap_init{heapstats::snapshot().live};
+#endif
+  for (uint32_t i = 0; i < point.removals;) {
+    const auto removed = static_cast<uint32_t>(rng() % size);
+    if (working[removed]) {
+      engine.removeBucket(removed);
+      working[removed] = 0;
+      ++i;
+    }
+  }
+#ifdef USE_HEAPSTATS
+  if (point.removals) {
+    point.removal_bytes =
+        static_cast<double>(heapstats::snapshot().live - heap_init) /
+        point.removals;
+  }
+#endif
+
+  volatile int64_t bucket{0};
+  for (uint32_t r = 0; r < options.warmup + options.repetitions; ++r) {
+    Stopwatch watch;
+    for (const auto &k : keys) {
+      bucket = engine.getBucketCRC32c(k.key, k.seed);
+    }
+    const auto elapsed{std::max(watch.seconds(), 1e-9)};
+    if (r >= options.warmup) {
+      point.rates.push_back(keys.size() / elapsed / 1e6);
+    }
+  }
+  point.summary = summarize(point.rates);
+  return point;
+}
+
+/*
+ * Writes the results as JSON, with the repetitions of every point
+ */
+void write_json(const std::string &filename, const std::vector<Point> &points,
+                const SweepOptions &options) {
+  std::ofstream out{filename};
+  out << fmt::format("{{\n  \"keys\": \"{}\",\n  \"num_keys\": {},\n  "
+                     "\"warmup\": {},\n  \"repetitions\": {},\n  \"seed\": "
+                     "{},\n  \"results\": [",
+                     options.key_source, options.num_keys, options.warmup,
+                     options.repetitions, options.seed);
+  for (size_t i = 0; i < points.size(); ++i) {
+    const auto &p = points[i];
+    std::string rates;
+    for (size_t r = 0; r < p.rates.size(); ++r) {
+      rates += fmt::format("{}{}", r ? ", " : "", p.rates[r]);
+    }
+    out << fmt::format(
+        "{}\n    {{\"algorithm\": \"{}\", \"name\": \"{}\", \"anchor\": {}, "
+        "\"working\": {}, \"removals\": {}, \"removal_ratio\": {}, "
+        "\"num_keys\": {}, \"median\": {}, \"ci_low\": {}, \"ci_high\": {}, "
+        "\"coverage\": {}, \"mean\": {}, \"min\": {}, \"max\": {}, "
+        "\"bytes_per_removal\": {}, \"rates\": [{}]}}",
+        i ? "," : "", p.algorithm, p.name, p.size, p.size, p.removals,
+        p.ratio, p.num_keys, p.summary.median, p.summary.low, p.summary.high,
+        p.summary.coverage, p.summary.mean, p.summary.min, p.summary.max,
+        p.removal_bytes, rates);
+  }
+  out << "\n  ]\n}\n";
+}
+
+inline constexpr const char *CSV_HEADER =
+    "algorithm,name,anchor,working,removals,removal_ratio,num_keys,median,"
+    "ci_low,ci_high,coverage,mean,min,max,bytes_per_removal,rates";
+
+/*
+ * Writes the results as CSV, one row per point (the rates of the
+ * repetitions are separated by spaces)
+ */
+void write_csv(const std::string &filename, const std::vector<Point> &points) {
+  std::ofstream out{filename};
+  out << CSV_HEADER << "\n";
+  for (const auto &p : points) {
+    std::string rates;
+    for (size_t r = 0; r < p.rates.size(); ++r) {
+      rates += fmt::format("{}{}", r ? " " : "", p.rates[r]);
+    }
+    out << fmt::format("{},\"{}\",{},{},{},{},{},{},{},{},{},{},{},{},{},{}\n",
+                       p.algorithm, p.name, p.size, p.size, p.removals,
+                       p.ratio, p.num_keys, p.summary.median, p.summary.low,
+                       p.summary.high, p.summary.coverage, p.summary.mean,
+                       p.summary.min, p.summary.max, p.removal_bytes, rates);
+  }
+}
+
+/*
+ * Splits a CSV line (fields may be quoted)
+ */
+std::vector<std::string> split_csv(const std::string &line) {
+  std::vector<std::string> fields{""};
+  bool quoted{false};
+  for (auto c : line) {
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (c == ',' && !quoted) {
+      fields.emplace_back();
+    } else {
+      fields.back() += c;
+    }
+  }
+  return fields;
+}
+
+/*
+ * Reads the points of a CSV file written by the sweep
+ */
+std::vector<Point> read_csv(const std::string &filename) {
+  std::ifstream in{filename};
+  std::string line;
+  if (!std::getline(in, line) || line != CSV_HEADER) {
+    throw std::runtime_error{fmt::format("{} is not a sweep CSV file",
+                                         filename)};
+  }
+  std::vector<Point> points;
+  while (std::getline(in, line)) {
+    auto f = split_csv(line);
+    if (f.size() != 16) {
+      continue;
+    }
+    std::vector<double> rates;
+    for (const auto &r : splitList(f[15], ' ')) {
+      rates.push_back(std::stod(r));
+    }
+    const auto summary = summarize(rates);
+    points.push_back(Point{.algorithm = f[0],
+                           .name = f[1],
+                           .size = static_cast<uint32_t>(std::stoul(f[3])),
+                           .removals = static_cast<uint32_t>(std::stoul(f[4])),
+                           .ratio = std::stod(f[5]),
+                           .num_keys = static_cast<uint32_t>(std::stoul(f[6])),
+                           .rates = std::move(rates),
+                           .summary = summary,
+                           .removal_bytes = std::stod(f[14])});
+  }
+  return points;
+}
+
+/*
+ * ******************************************
+ * Sweep routine
+ * ******************************************
+ */
+int sweep(const SweepOptions &options) {
+  if (options.core >= 0 && !pin_to_core(options.core)) {
+    fmt::println("Could not pin the sweep to core {}", options.core);
+  }
+
+  /* The same keys for every point */
+  KeySource source{options.key_source, options.keyspace, options.seed};
+  const auto keys{source.generate(options.num_keys)};
+
+  std::vector<Point> points;
+  for (const auto &algorithm : options.algorithms) {
+    for (auto size : options.sizes) {
+      for (auto ratio : options.ratios) {
+        auto result = Algorithms::dispatch(
+            algorithm, [&]<typename Algorithm>(const std::string &name) {
+              points.push_back(measure<Algorithm>(algorithm, name, size,
+                                                  ratio, keys, options));
+              return 0;
+            });
+        if (result) {
+          return result;
+        }
+        const auto &p = points.back();
+        std::string heap;
+#ifdef USE_HEAPSTATS
+        if (p.removals) {
+          heap = fmt::format(", {:.1f} bytes per removed bucket",
+                             p.removal_bytes);
+        }
+#endif
+        fmt::println("{} Working {} Removals {} ({}%): median {:.3f} "
+                     "Mkeys/s, 95% CI [{:.3f}, {:.3f}] ({} repetitions){}",
+                     p.name, p.size, p.removals, 100.0 * p.ratio,
+                     p.summary.median, p.summary.low, p.summary.high,
+                     p.summary.count, heap);
+      }
+    }
+  }
+
+  if (!options.json.empty()) {
+    write_json(options.json, points, options);
+  }
+  if (!options.csv.empty()) {
+    write_csv(options.csv, points);
+  }
+  return 0;
+}
+
+/*
+ * ******************************************
+ * Compare routine: the points of two CSV files are matched by algorithm,
+ * size and removals; a point is a regression when its median rate drops
+ * by more than threshold and the Mann-Whitney test of the repetitions is
+ * significant at level alpha
+ * ******************************************
+ */
+int compare(const std::string &base_file, const std::string &new_file,
+            double alpha, double threshold) {
+  const auto base{read_csv(base_file)};
+  const auto current{read_csv(new_file)};
+
+  using PointKey = std::tuple<std::string, uint32_t, uint32_t>;
+  std::map<PointKey, const Point *> index;
+  for (const auto &p : base) {
+    index[{p.algorithm, p.size, p.removals}] = &p;
+  }
+
+  uint32_t regressions{0}, improvements{0}, compared{0};
+  for (const auto &p : current) {
+    auto b = index.find({p.algorithm, p.size, p.removals});
+    if (b == index.end()) {
+      continue;
+    }
+    const auto &old = *b->second;
+    ++compared;
+    const auto change = old.summary.median > 0
+                            ? p.summary.median / old.summary.median - 1.0
+                            : 0.0;
+    const auto pvalue = mannWhitneyP(old.rates, p.rates);
+    const char *verdict = "";
+    if (pvalue < alpha && change < -threshold) {
+      verdict = " REGRESSION";
+      ++regressions;
+    } else if (pvalue < alpha && change > threshold) {
+      verdict = " improvement";
+      ++improvements;
+    }
+    fmt::println("{} Working {} Removals {}: {:.3f} -> {:.3f} Mkeys/s "
+                 "({:+.1f}%, p = {:.3g}){}",
+                 p.name, p.size, p.removals, old.summary.median,
+                 p.summary.median, 100.0 * change, pvalue, verdict);
+  }
+  fmt::println("{} points compared, {} regressions, {} improvements "
+               "(alpha {}, threshold {}%)",
+               compared, regressions, improvements, alpha, 100.0 * threshold);
+  return regressions ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  cxxopts::Options options(
+      "sweep", "Parameter sweep with repetitions and confidence intervals");
+  options.add_options()("Command", "run or compare",
+                        cxxopts::value<std::string>())(
+      "Base", "CSV file of the base results (compare)",
+      cxxopts::value<std::string>()->default_value(""))(
+      "New", "CSV file of the new results (compare)",
+      cxxopts::value<std::string>()->default_value(""))(
+      "algorithms",
+      "Comma separated algorithms (" + Algorithms::names() + "), or all",
+      cxxopts::value<std::string>()->default_value("all"))(
+      "sizes", "Comma separated sizes of the WorkingSet",
+      cxxopts::value<std::string>()->default_value("1000,1000000"))(
+      "removals", "Comma separated fractions of the WorkingSet removed",
+      cxxopts::value<std::string>()->default_value("0,0.5,0.9"))(
+      "num-keys", "Number of keys looked up by each repetition",
+      cxxopts::value<int>()->default_value("1000000"))(
+      "warmup", "Number of unmeasured runs before the repetitions",
+      cxxopts::value<int>()->default_value("2"))(
+      "repetitions", "Number of measured runs of each point",
+      cxxopts::value<int>()->default_value("10"))(
+      "core", "Core the sweep is pinned to (-1 to leave it unpinned)",
+      cxxopts::value<int>()->default_value("0"))(
+      "keys", "Key source (uniform|zipf:S|hotspot:F:P|sequential)",
+      cxxopts::value<std::string>()->default_value("uniform"))(
+      "keyspace", "Number of distinct keys (zipf and hotspot)",
+      cxxopts::value<int>()->default_value("1000000"))(
+      "seed", "Seed for keys and removals",
+      cxxopts::value<uint64_t>()->default_value("42"))(
+      "json", "JSON output file",
+      cxxopts::value<std::string>()->default_value(""))(
+      "csv", "CSV output file (read by compare)",
+      cxxopts::value<std::string>()->default_value(""))(
+      "alpha", "Significance level of compare",
+      cxxopts::value<double>()->default_value("0.05"))(
+      "threshold", "Smallest relative change of the median reported by "
+                   "compare",
+      cxxopts::value<double>()->default_value("0.02"));
+  options.positional_help("run|compare [base.csv new.csv]");
+  options.parse_positional({"Command", "Base", "New"});
+  auto result = options.parse(argc, argv);
+  if (!result.count("Command")) {
+    fmt::println("{}", options.help());
+    exit(1);
+  }
+
+  auto command = result["Command"].as<std::string>();
+  if (command == "compare") {
+    auto base_file = result["Base"].as<std::string>();
+    auto new_file = result["New"].as<std::string>();
+    if (base_file.empty() || new_file.empty()) {
+      fmt::println("compare needs the base and the new CSV files");
+      return 2;
+    }
+    try {
+      return compare(base_file, new_file, result["alpha"].as<double>(),
+                     result["threshold"].as<double>());
+    } catch (const std::exception &e) {
+      fmt::println("{}", e.what());
+      return 2;
+    }
+  }
+  if (command != "run") {
+    fmt::println("Unknown command {}", command);
+    return 2;
+  }
+
+  auto algorithms = result["algorithms"].as<std::string>();
+  std::vector<uint32_t> sizes;
+  for (const auto &s : splitList(result["sizes"].as<std::string>())) {
+    sizes.push_back(std::max(static_cast<uint32_t>(std::stoul(s)), 1u));
+  }
+  std::vector<double> ratios;
+  for (const auto &r : splitList(result["removals"].as<std::string>())) {
+    ratios.push_back(std::clamp(std::stod(r), 0.0, 1.0));
+  }
+  SweepOptions sweep_options{
+      .algorithms = splitList(algorithms == "all" ? Algorithms::names()
+                                                   : algorithms,
+                               algorithms == "all" ? '|' : ','),
+      .sizes = std::move(sizes),
+      .ratios = std::move(ratios),
+      .num_keys = static_cast<uint32_t>(result["num-keys"].as<int>()),
+      .warmup = static_cast<uint32_t>(result["warmup"].as<int>()),
+      .repetitions =
+          static_cast<uint32_t>(std::max(result["repetitions"].as<int>(), 1)),
+      .core = result["core"].as<int>(),
+      .key_source = result["keys"].as<std::string>(),
+      .keyspace = static_cast<uint32_t>(result["keyspace"].as<int>()),
+      .seed = result["seed"].as<uint64_t>(),
+      .json = result["json"].as<std::string>(),
+      .csv = result["csv"].as<std::string>()};
+
+  fmt::println("Algorithms: {}, Sizes: {}, Removals: {}, NumKeys: {}, "
+               "Warmup: {}, Repetitions: {}, Keys: {}, Seed: {}",
+               algorithms, result["sizes"].as<std::string>(),
+               result["removals"].as<std::string>(), sweep_options.num_keys,
+               sweep_options.warmup, sweep_options.repetitions,
+               sweep_options.key_source, sweep_options.seed);
+  return sweep(sweep_options);
+}
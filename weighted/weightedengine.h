@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2023 Amos Brocco.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WEIGHTEDENGINE_H
+#define WEIGHTEDENGINE_H
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Adds weighted capacity to an engine (MementoEngine, AnchorEngine).
+ *
+ * Each bucket has an integer weight in [1,maxWeight], kept while the bucket
+ * is removed. The engine resolves a key as usual, but every candidate it
+ * draws (uniformly over the buckets, working or not, that the current step
+ * draws from) is kept with probability weight / maxWeight and drawn again
+ * from the same step otherwise (see getBucketWeightedCRC32c). A kept
+ * working candidate is the result, a kept removed one is resolved by the
+ * engine as usual. Every step thus ends on a working bucket with probability
+ * proportional to its weight, so a bucket of weight w receives w times the
+ * keys of a bucket of weight 1, without materializing virtual buckets:
+ * memory is a weight and a threshold per bucket id.
+ *
+ * The candidates and their thresholds do not depend on which buckets are
+ * working, so the mapping is as monotone as the one of the engine: removing
+ * a bucket only moves its keys, adding it back restores the previous
+ * mapping, and raising (lowering) the weight of a working bucket only moves
+ * keys to (away from) it. A bucket added past the id space of the engine
+ * (beyond the anchor set) must have the maximum weight for this to hold.
+ *
+ * A lookup costs about maxWeight / (average weight) candidates per step of
+ * the engine (e.g. 1.7 with the weights 1,2,4), each a hash and a load.
+ */
+template <typename Engine> class WeightedEngine final {
+public:
+  /**
+   * Creates a new weighted engine.
+   *
+   * @param anchor_set    size of the anchor set (forwarded to the engine)
+   * @param working_set   initial number of working buckets
+   * @param max_weight    the maximum weight of a bucket (0 < max_weight);
+   *                      every bucket initially gets this weight
+   */
+  WeightedEngine(uint32_t anchor_set, uint32_t working_set,
+                 uint32_t max_weight = 1)
+      : m_engine{anchor_set, working_set},
+        m_weights(std::max(anchor_set, working_set), max_weight),
+        m_thresholds(m_weights.size(), threshold(max_weight, max_weight)),
+        m_maxWeight{max_weight} {}
+
+  /**
+   * Returns the bucket where the given key should be mapped.
+   *
+   * @param key the key to map
+   * @param seed the initial seed for CRC32c
+   * @return the related bucket
+   */
+  uint32_t getBucketCRC32c(uint64_t key, uint64_t seed) const noexcept {
+    return m_engine.getBucketWeightedCRC32c(key, seed, m_thresholds);
+  }
+
+  /**
+   * Adds a new bucket to the engine.
+   *
+   * @param weight the weight of the new bucket (clamped to [1,maxWeight])
+   * @return the added bucket
+   */
+  uint32_t addBucket(uint32_t weight) noexcept {
+    auto b = addBucket();
+    setWeight(b, weight);
+    return b;
+  }
+
+  /**
+   * Adds a new bucket to the engine. A bucket that was removed gets back
+   * its weight (so that the previous mapping is restored), a new one gets
+   * the maximum weight.
+   *
+   * @return the added bucket
+   */
+  uint32_t addBucket() noexcept {
+    auto b = m_engine.addBucket();
+    if (b >= m_weights.size()) {
+      m_weights.resize(b + 1, m_maxWeight);
+      m_thresholds.resize(b + 1, threshold(m_maxWeight, m_maxWeight));
+    }
+    return b;
+  }
+
+  /**
+   * Removes the given bucket from the engine.
+   *
+   * @param bucket the bucket to remove
+   * @return the removed bucket
+   */
+  uint32_t removeBucket(uint32_t bucket) noexcept {
+    return m_engine.removeBucket(bucket);
+  }
+
+  /**
+   * Changes the weight of a bucket. Since maxWeight does not change,
+   * raising the weight of a working bucket only moves keys to that bucket
+   * and lowering it only moves keys away from it (changing the weight of a
+   * removed bucket moves keys between working buckets).
+   *
+   * @param bucket the bucket
+   * @param weight the new weight (clamped to [1,maxWeight])
+   */
+  void setWeight(uint32_t bucket, uint32_t weight) {
+    if (bucket >= m_weights.size()) {
+      m_weights.resize(bucket + 1, m_maxWeight);
+      m_thresholds.resize(bucket + 1, threshold(m_maxWeight, m_maxWeight));
+    }
+    m_weights[bucket] = std::clamp(weight, 1u, m_maxWeight);
+    m_thresholds[bucket] = threshold(m_weights[bucket], m_maxWeight);
+  }
+
+  /**
+   * Returns the weight of a bucket.
+   *
+   * @param bucket the bucket
+   * @return the weight of the bucket
+   */
+  uint32_t weight(uint32_t bucket) const noexcept { return m_weights[bucket]; }
+
+  /**
+   * Returns the maximum weight of a bucket.
+   *
+   * @return the maximum weight
+   */
+  uint32_t maxWeight() const noexcept { return m_maxWeight; }
+
+private:
+  /* 2^31 times the probability of keeping a candidate (never 0) */
+  static uint32_t threshold(uint32_t weight, uint32_t max_weight) noexcept {
+    return static_cast<uint32_t>((static_cast<uint64_t>(weight) << 31) /
+                                 max_weight);
+  }
+
+  Engine m_engine;
+  std::vector<uint32_t> m_weights;
+  /* Per bucket id: 2^31 * weight / maxWeight */
+  std::vector<uint32_t> m_thresholds;
+  uint32_t m_maxWeight;
+};
+
+#endif // WEIGHTEDENGINE_H